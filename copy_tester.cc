@@ -0,0 +1,272 @@
+//
+// Copy tester: counts the heap allocations a write or a read of one
+// extent's data costs on its way through the RPC layer and the extent
+// client and server, all in this process. A copy of the data shows up
+// as an allocation of about its size; marshalling into the RPC buffers
+// is done with malloc and is not counted.
+//
+// The rpc part registers each handler twice, once taking its data by
+// value and once by const reference through rpc_arg<>, and checks that
+// the reference saves the copy. The extent part reports put, put_range
+// and get as extent_client does them, a write-back included.
+// It eventually says "copy_tester OK".
+//
+
+#include "extent_client.h"
+#include "extent_server.h"
+#include "rpc.h"
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <new>
+#include "lang/verify.h"
+
+// bytes of data per operation, a multiple of CACHE_PAGE_SIZE that still
+// fits in one extent
+#define PAYLOAD (16 * CACHE_PAGE_SIZE)
+#define ROUNDS 20
+
+static volatile bool counting;
+static unsigned long long nallocs, nbytes, nbig;
+
+void *
+operator new(size_t n)
+{
+  if (counting) {
+    __sync_fetch_and_add(&nallocs, 1ULL);
+    __sync_fetch_and_add(&nbytes, (unsigned long long)n);
+    if (n >= PAYLOAD)
+      __sync_fetch_and_add(&nbig, 1ULL);
+  }
+  void *p = malloc(n ? n : 1);
+  if (p == NULL)
+    throw std::bad_alloc();
+  return p;
+}
+
+void
+operator delete(void *p) throw()
+{
+  free(p);
+}
+
+struct counts {
+  double allocs, copies, bytes;
+};
+
+static void
+start_count()
+{
+  nallocs = nbytes = nbig = 0;
+  __sync_synchronize();
+  counting = true;
+}
+
+// per round, averaged over ROUNDS rounds
+static counts
+stop_count()
+{
+  counts c;
+  counting = false;
+  __sync_synchronize();
+  c.allocs = (double)nallocs / ROUNDS;
+  c.copies = (double)nbig / ROUNDS;
+  c.bytes = (double)nbytes / ROUNDS / PAYLOAD;
+  return c;
+}
+
+static void
+report(const char *what, const counts &c)
+{
+  printf("  %-28s %6.1f allocs  %4.1f payload-size  %5.2f x payload bytes\n",
+         what, c.allocs, c.copies, c.bytes);
+}
+
+// rpc handlers shaped like extent_server's put, put_range and get, with
+// the data by value, as all handlers had it before rpc_arg<>, and by
+// const reference. They only look at the data, so any copy is the rpc
+// layer's.
+class srv {
+ public:
+  std::string stored;
+  int put_val(unsigned long long eid, std::string buf, int &r);
+  int put_ref(unsigned long long eid, const std::string &buf, int &r);
+  int put_range_val(unsigned long long eid, unsigned int off, std::string buf,
+                    int &r);
+  int put_range_ref(unsigned long long eid, unsigned int off,
+                    const std::string &buf, int &r);
+  int get(unsigned long long eid, std::string &buf);
+};
+
+enum { PUT_VAL = 30, PUT_REF, PUT_RANGE_VAL, PUT_RANGE_REF, GET };
+
+int
+srv::put_val(unsigned long long eid, std::string buf, int &r)
+{
+  r = buf.size();
+  return 0;
+}
+
+int
+srv::put_ref(unsigned long long eid, const std::string &buf, int &r)
+{
+  r = buf.size();
+  return 0;
+}
+
+int
+srv::put_range_val(unsigned long long eid, unsigned int off, std::string buf,
+                   int &r)
+{
+  r = buf.size();
+  return 0;
+}
+
+int
+srv::put_range_ref(unsigned long long eid, unsigned int off,
+                   const std::string &buf, int &r)
+{
+  r = buf.size();
+  return 0;
+}
+
+int
+srv::get(unsigned long long eid, std::string &buf)
+{
+  buf = stored;
+  return 0;
+}
+
+static void
+rpc_test(int port)
+{
+  srv service;
+  rpcs server(port);
+  struct sockaddr_in dst;
+  std::string data(PAYLOAD, 'x'), buf;
+  counts val, ref;
+  int r, i;
+
+  service.stored = data;
+  server.reg(PUT_VAL, &service, &srv::put_val);
+  server.reg(PUT_REF, &service, &srv::put_ref);
+  server.reg(PUT_RANGE_VAL, &service, &srv::put_range_val);
+  server.reg(PUT_RANGE_REF, &service, &srv::put_range_ref);
+  server.reg(GET, &service, &srv::get);
+
+  memset(&dst, 0, sizeof(dst));
+  dst.sin_family = AF_INET;
+  dst.sin_addr.s_addr = inet_addr("127.0.0.1");
+  dst.sin_port = htons(port);
+  rpcc cl(dst);
+  VERIFY(cl.bind() == 0);
+
+  printf("rpc layer, %d bytes per call:\n", PAYLOAD);
+
+  start_count();
+  for (i = 0; i < ROUNDS; i++)
+    VERIFY(cl.call(PUT_VAL, 1ULL, data, r) == 0 && r == PAYLOAD);
+  val = stop_count();
+  report("put, by value", val);
+  start_count();
+  for (i = 0; i < ROUNDS; i++)
+    VERIFY(cl.call(PUT_REF, 1ULL, data, r) == 0 && r == PAYLOAD);
+  ref = stop_count();
+  report("put, by const reference", ref);
+  VERIFY(ref.copies + 1 <= val.copies);
+
+  start_count();
+  for (i = 0; i < ROUNDS; i++)
+    VERIFY(cl.call(PUT_RANGE_VAL, 1ULL, 0U, data, r) == 0 && r == PAYLOAD);
+  val = stop_count();
+  report("put_range, by value", val);
+  start_count();
+  for (i = 0; i < ROUNDS; i++)
+    VERIFY(cl.call(PUT_RANGE_REF, 1ULL, 0U, data, r) == 0 && r == PAYLOAD);
+  ref = stop_count();
+  report("put_range, by const reference", ref);
+  VERIFY(ref.copies + 1 <= val.copies);
+
+  // a result is filled in by the handler, so rpc_arg<> changes nothing
+  start_count();
+  for (i = 0; i < ROUNDS; i++)
+    VERIFY(cl.call(GET, 1ULL, buf) == 0 && buf.size() == PAYLOAD);
+  report("get", stop_count());
+}
+
+static void
+extent_test(int port)
+{
+  rpcs server(port);
+  extent_server es;
+  char dst[16];
+  std::string data(PAYLOAD, 'y'), buf;
+  extent_protocol::extentid_t eid;
+  int i;
+
+  server.reg(extent_protocol::get, &es, &extent_server::get);
+  server.reg(extent_protocol::getattr, &es, &extent_server::getattr);
+  server.reg(extent_protocol::get_if_changed, &es, &extent_server::get_if_changed);
+  server.reg(extent_protocol::put, &es, &extent_server::put);
+  server.reg(extent_protocol::create, &es, &extent_server::create);
+  server.reg(extent_protocol::create_v2, &es, &extent_server::create_v2);
+  server.reg(extent_protocol::get_range, &es, &extent_server::get_range);
+  server.reg(extent_protocol::put_range, &es, &extent_server::put_range);
+  server.reg(extent_protocol::compound, &es, &extent_server::compound);
+
+  snprintf(dst, sizeof(dst), "%d", port);
+  extent_client ec(dst);
+  VERIFY(ec.create(extent_protocol::T_FILE, eid) == extent_protocol::OK);
+
+  printf("extent client and server, %d bytes per call:\n", PAYLOAD);
+
+  start_count();
+  for (i = 0; i < ROUNDS; i++) {
+    data[0] = 'a' + i;
+    VERIFY(ec.put(eid, data) == extent_protocol::OK);
+    VERIFY(ec.flush(eid) == extent_protocol::OK);
+  }
+  report("put and write-back", stop_count());
+
+  start_count();
+  for (i = 0; i < ROUNDS; i++) {
+    data[0] = 'a' + i;
+    VERIFY(ec.put_range(eid, 0, data) == extent_protocol::OK);
+    VERIFY(ec.flush(eid) == extent_protocol::OK);
+  }
+  report("put_range and write-back", stop_count());
+
+  // a reader with no room in its cache drops each copy after the get,
+  // so every get goes to the server
+  VERIFY(setenv("YFS_CACHE_BYTES", "1", 1) == 0);
+  extent_client rd(dst);
+  VERIFY(unsetenv("YFS_CACHE_BYTES") == 0);
+  start_count();
+  for (i = 0; i < ROUNDS; i++)
+    VERIFY(rd.get(eid, buf) == extent_protocol::OK);
+  report("get from the server", stop_count());
+  VERIFY(buf == data);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int port;
+
+  setvbuf(stdout, NULL, _IONBF, 0);
+  setvbuf(stderr, NULL, _IONBF, 0);
+
+  if (argc > 2) {
+    fprintf(stderr, "Usage: %s [port]\n", argv[0]);
+    exit(1);
+  }
+  port = argc > 1 ? atoi(argv[1]) : 20000 + (getpid() % 10000);
+
+  rpc_test(port);
+  extent_test(port + 1);
+
+  printf("%s: copy_tester OK\n", argv[0]);
+  exit(0);
+}
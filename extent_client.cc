@@ -6,21 +6,847 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <time.h>
+#include <sys/time.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <dirent.h>
+#include <sys/stat.h>
+
+// Read-ahead windows, in pages: the first one a sequential read opens,
+// and the largest unless YFS_READAHEAD says otherwise.
+#define RA_MIN_WINDOW 4
+#define RA_MAX_WINDOW 16
+// Windows waiting for the read-ahead thread, at most.
+#define RA_MAX_QUEUED 32
+
+// How long attributes prefetched by readdir_plus are trusted, and the
+// results of dir_lookup (seconds), unless YFS_ATTR_TTL or
+// YFS_LOOKUP_TTL says otherwise.
+#define PREFETCH_ATTR_TTL 1
+#define LOOKUP_TTL 30
+// Names whose lookup is remembered, at most, per directory.
+#define LOOKUP_NAMES_MAX 1024
+
+// Dirty spans of a page closer than this (bytes) go back as one, and a
+// page with more than SPANS_MAX of them goes back from first to last.
+#define SPAN_GAP 64
+#define SPANS_MAX 16
+
+int extent_client::last_port = 0;
+
+void *
+flusher_thread(void *ec)
+{
+  extent_client *clt = (extent_client *)ec;
+  clt->flusher();
+  pthread_exit(NULL);
+}
+
+void *
+prefetcher_thread(void *ec)
+{
+  extent_client *clt = (extent_client *)ec;
+  clt->prefetcher();
+  pthread_exit(NULL);
+}
+
+// One shard's compound RPC of a write-back, sent from a thread of its
+// own so that the shards are written to at the same time.
+struct compound_call {
+  extent_shard *cl;
+  std::vector<extent_protocol::op> *ops;
+  std::vector<extent_protocol::result> res;
+  extent_protocol::status ret;
+};
+
+void *
+compound_thread(void *cc)
+{
+  compound_call *c = (compound_call *)cc;
+  c->ret = c->cl->call(extent_protocol::compound, *c->ops, c->res);
+  pthread_exit(NULL);
+}
 
 extent_client::extent_client(std::string dst)
 {
-  sockaddr_in dstsock;
-  make_sockaddr(dst.c_str(), &dstsock);
-  cl = new rpcc(dstsock);
-  if (cl->bind() != 0) {
-    dprintf("extent_client: bind failed\n");
-  }
+  std::string d;
+  std::istringstream ist(dst);
+  while (std::getline(ist, d, ','))
+    cls.push_back(new extent_shard(d));
+  VERIFY(!cls.empty());
+  next_shard = 0;
   VERIFY(pthread_mutex_init(&mx, NULL) == 0);
+  for (uint32_t k = 0; k < CACHE_STRIPES; ++k) {
+    VERIFY(pthread_mutex_init(&stripes[k].mx, NULL) == 0);
+    VERIFY(pthread_cond_init(&stripes[k].cv, NULL) == 0);
+    stripes[k].clock_hand = 0;
+  }
+
+  // YFS_CACHE_BYTES=<bytes> bounds the cached pages; see evict()
+  resident_bytes = dirty_bytes = 0;
+  next_stripe = 0;
+  cache_budget = 0;
+  char *budget_env = getenv("YFS_CACHE_BYTES");
+  if (budget_env != NULL && atoll(budget_env) > 0)
+    cache_budget = atoll(budget_env);
+
+  // YFS_FLUSH_AGE=<seconds> and YFS_FLUSH_BYTES=<bytes> turn on the
+  // background flusher
+  VERIFY(pthread_cond_init(&fcv, NULL) == 0);
+  flush_age = 0;
+  flush_bytes = 0;
+  char *age_env = getenv("YFS_FLUSH_AGE");
+  if (age_env != NULL && atoi(age_env) > 0)
+    flush_age = atoi(age_env);
+  char *bytes_env = getenv("YFS_FLUSH_BYTES");
+  if (bytes_env != NULL && atoll(bytes_env) > 0)
+    flush_bytes = atoll(bytes_env);
+  stopping = false;
+  flusher_on = flush_age > 0 || flush_bytes > 0;
+  if (flusher_on)
+    VERIFY(pthread_create(&flusher_th, NULL, flusher_thread, (void *)this) == 0);
+
+  // YFS_READAHEAD=<pages> caps the read-ahead window; 0 turns it off
+  VERIFY(pthread_cond_init(&racv, NULL) == 0);
+  ra_max = RA_MAX_WINDOW;
+  char *ra_env = getenv("YFS_READAHEAD");
+  if (ra_env != NULL && atoi(ra_env) >= 0)
+    ra_max = atoi(ra_env);
+  if (ra_max > 0)
+    VERIFY(pthread_create(&ra_th, NULL, prefetcher_thread, (void *)this) == 0);
+
+  // YFS_ATTR_TTL=<seconds> for attributes readdir_plus prefetches, and
+  // YFS_LOOKUP_TTL=<seconds> for dir_lookup results; 0 turns either off
+  attr_ttl = PREFETCH_ATTR_TTL;
+  char *attr_env = getenv("YFS_ATTR_TTL");
+  if (attr_env != NULL && atoi(attr_env) >= 0)
+    attr_ttl = atoi(attr_env);
+  lookup_ttl = LOOKUP_TTL;
+  char *lookup_env = getenv("YFS_LOOKUP_TTL");
+  if (lookup_env != NULL && atoi(lookup_env) >= 0)
+    lookup_ttl = atoi(lookup_env);
+
+  // YFS_LEASES=1 turns on read leases; the server calls them back on a
+  // port of our own, as the lock server does for lock_client_cache
+  VERIFY(pthread_mutex_init(&lmx, NULL) == 0);
+  char *leases_env = getenv("YFS_LEASES");
+  use_leases = leases_env != NULL && atoi(leases_env) > 0;
+  if (use_leases) {
+    srand(time(NULL) ^ last_port ^ getpid());
+    int port = (rand() % 32000) | (0x1 << 10);
+    last_port = port;
+    std::ostringstream host;
+    host << "127.0.0.1:" << port;
+    id = host.str();
+    rpcs *rsrpc = new rpcs(port);
+    rsrpc->reg(rextent_protocol::invalidate, this,
+               &extent_client::invalidate_handler);
+  }
+
+  // YFS_CACHE_DIR=<dir> keeps clean copies on local disk from one run
+  // to the next; see save() and restore()
+  char *dir_env = getenv("YFS_CACHE_DIR");
+  if (dir_env != NULL && dir_env[0] != '\0') {
+    cache_dir = dir_env;
+    mkdir(cache_dir.c_str(), 0755);
+    restore();
+  }
+}
+
+extent_shard::extent_shard(std::string dst)
+{
+  std::string d;
+  std::istringstream ist(dst);
+  while (std::getline(ist, d, '|'))
+    addrs.push_back(d);
+  VERIFY(!addrs.empty());
+  primary = next_read = 0;
+  VERIFY(pthread_mutex_init(&smx, NULL) == 0);
+
+  single = NULL;
+  if (addrs.size() == 1) {
+    sockaddr_in dstsock;
+    make_sockaddr(addrs[0].c_str(), &dstsock);
+    single = new rpcc(dstsock);
+    if (single->bind() != 0) {
+      dprintf("extent_client: bind %s failed\n", addrs[0].c_str());
+    }
+  }
+}
+
+bool
+extent_shard::is_read(unsigned int proc)
+{
+  return proc == extent_protocol::get || proc == extent_protocol::getattr ||
+         proc == extent_protocol::get_range || proc == extent_protocol::dir_lookup ||
+         proc == extent_protocol::readdir_plus ||
+         proc == extent_protocol::get_if_changed;
+}
+
+uint32_t
+extent_shard::pick(bool read)
+{
+  uint32_t idx;
+
+  pthread_mutex_lock(&smx);
+  if (read)
+    idx = next_read++ % addrs.size();
+  else
+    idx = primary;
+  pthread_mutex_unlock(&smx);
+  return idx;
+}
+
+// Decide whether a call that returned ret from replica idx should be
+// tried again, and where the primary is to be looked for next.
+bool
+extent_shard::retry(uint32_t idx, int ret, int tries)
+{
+  if (ret >= 0 && ret != extent_protocol::NOTPRIMARY)
+    return false;
+  // a takeover needs at most REPL_FAILOVER per replica; allow twice that
+  if (tries >= (int)addrs.size() * 2 * REPL_FAILOVER) {
+    printf("extent_client: no primary among %u replicas\n", (uint32_t)addrs.size());
+    return false;
+  }
+
+  pthread_mutex_lock(&smx);
+  if (idx == primary)
+    primary = (primary + 1) % addrs.size();
+  pthread_mutex_unlock(&smx);
+  // every replica refused or failed: give a backup time to take over
+  if ((tries + 1) % addrs.size() == 0)
+    sleep(1);
+  return true;
+}
+
+uint32_t
+extent_client::shard_of(extent_protocol::extentid_t eid)
+{
+  eid &= 0x7fffffff;
+  if (eid == 0)
+    return 0;
+  return (eid - 1) % cls.size();
 }
 
 extent_client::~extent_client()
 {
   dprintf("extent_client: destroying..\n");
+  shutdown();
+}
+
+void
+extent_client::shutdown()
+{
+  pthread_mutex_lock(&mx);
+  if (stopping) {
+    pthread_mutex_unlock(&mx);
+    return;
+  }
+  stopping = true;
+  VERIFY(pthread_cond_signal(&fcv) == 0);
+  VERIFY(pthread_cond_signal(&racv) == 0);
+  pthread_mutex_unlock(&mx);
+  if (flusher_on)
+    VERIFY(pthread_join(flusher_th, NULL) == 0);
+  if (ra_max > 0)
+    VERIFY(pthread_join(ra_th, NULL) == 0);
+  if (!cache_dir.empty())
+    save();
+}
+
+bool
+extent_client::attr_valid(const cache_content &c)
+{
+  // a dirty extent's attr was updated locally and is newer than the server's
+  return c.valid_attr &&
+         (c.attr_expire == 0 || c.dirty || time(NULL) < c.attr_expire);
+}
+
+static uint32_t
+npages(uint32_t size)
+{
+  return (size + CACHE_PAGE_SIZE - 1) / CACHE_PAGE_SIZE;
+}
+
+// the length of page i of an extent of the given size
+static uint32_t
+page_len(uint32_t i, uint32_t size)
+{
+  uint32_t off = i * CACHE_PAGE_SIZE;
+  if (off >= size)
+    return 0;
+  return std::min<uint32_t>(CACHE_PAGE_SIZE, size - off);
+}
+
+// attr.size is the extent's: read under its lock or a lease, or set here
+bool
+extent_client::size_known(const cache_content &c)
+{
+  return c.valid_attr && (c.attr_expire == 0 || c.dirty);
+}
+
+bool
+extent_client::complete(const cache_content &c)
+{
+  return size_known(c) && !c.kept && c.pages.size() == npages(c.attr.size);
+}
+
+// eid's entry, made if there is none, once no other thread is fetching
+// into it; a miss that was being fetched is then usually a hit. Called
+// with s.mx held.
+extent_client::cache_content &
+extent_client::entry(stripe &s, extent_protocol::extentid_t eid)
+{
+  std::map<extent_protocol::extentid_t, cache_content>::iterator it;
+
+  while ((it = s.entries.find(eid)) != s.entries.end() && it->second.busy)
+    VERIFY(pthread_cond_wait(&s.cv, &s.mx) == 0);
+  return s.entries[eid];
+}
+
+// Wait until eid's entry is neither being fetched or read ahead into
+// nor written back, so that it can be dropped and what the server has
+// can be relied on. Called with s.mx held.
+void
+extent_client::wait_idle(stripe &s, extent_protocol::extentid_t eid)
+{
+  std::map<extent_protocol::extentid_t, cache_content>::iterator it;
+
+  while (s.writing.count(eid) ||
+         ((it = s.entries.find(eid)) != s.entries.end() &&
+          (it->second.busy || it->second.pinned || !it->second.ahead.empty())))
+    VERIFY(pthread_cond_wait(&s.cv, &s.mx) == 0);
+}
+
+// A fetch into eid's entry c runs with its stripe unlocked and c busy,
+// once any write-back of eid is answered, which the server would
+// otherwise be read from before. end_fetch tells whether c was left
+// alone meanwhile; if suspect() came in, what was fetched may predate
+// the change the server called back about.
+unsigned int
+extent_client::begin_fetch(stripe &s, extent_protocol::extentid_t eid,
+                           cache_content &c)
+{
+  c.busy = true;
+  while (s.writing.count(eid))
+    VERIFY(pthread_cond_wait(&s.cv, &s.mx) == 0);
+  pthread_mutex_unlock(&s.mx);
+  return c.gen;
+}
+
+bool
+extent_client::end_fetch(stripe &s, cache_content &c, unsigned int gen)
+{
+  pthread_mutex_lock(&s.mx);
+  c.busy = false;
+  VERIFY(pthread_cond_broadcast(&s.cv) == 0);
+  return c.gen == gen;
+}
+
+// Make sure eid's attributes are cached, and the pages in want (in
+// ascending order) that lie within the extent. Whatever is missing comes
+// in one compound RPC: a getattr if needed and a get_range per run of
+// missing pages. A kept copy is first checked against the server's
+// version with a getattr alone: its pages stay if the version has not
+// moved on, and only what is then missing is fetched. Called with s.mx
+// held and the entry not busy, as entry() leaves it; it is not busy on
+// return either.
+extent_protocol::status
+extent_client::load(stripe &s, extent_protocol::extentid_t eid,
+                    const std::vector<uint32_t> &want)
+{
+  cache_content &c = s.entries[eid];
+  extent_protocol::op o;
+  extent_protocol::status ret;
+  uint32_t i, k, n;
+
+  while (true) {
+    std::vector<std::pair<uint32_t, uint32_t> > runs;
+    std::vector<extent_protocol::op> ops;
+    std::vector<extent_protocol::result> res;
+    bool revalidate = c.kept;
+    bool need_attr = revalidate || !size_known(c);
+
+    // pages on their way from prefetch() are waited for, not asked for
+    // again; c is busy meanwhile, so it stays
+    for (k = 0; k < want.size() && !c.ahead.count(want[k]); ++k)
+      ;
+    if (k < want.size()) {
+      c.busy = true;
+      while (c.ahead.count(want[k]))
+        VERIFY(pthread_cond_wait(&s.cv, &s.mx) == 0);
+      c.busy = false;
+      VERIFY(pthread_cond_broadcast(&s.cv) == 0);
+      continue;
+    }
+
+    for (k = 0; !revalidate && k < want.size(); ++k) {
+      i = want[k];
+      if (!need_attr && i >= npages(c.attr.size))
+        break;
+      if (c.pages.count(i))
+        continue;
+      if (!runs.empty() && runs.back().second + 1 == i)
+        runs.back().second = i;
+      else
+        runs.push_back(std::make_pair(i, i));
+    }
+
+    o.eid = eid;
+    if (need_attr) {
+      o.type = extent_protocol::getattr;
+      o.off = o.len = 0;
+      ops.push_back(o);
+    }
+    for (k = 0; k < runs.size(); ++k) {
+      o.type = extent_protocol::get_range;
+      o.off = runs[k].first * CACHE_PAGE_SIZE;
+      o.len = (runs[k].second - runs[k].first + 1) * CACHE_PAGE_SIZE;
+      ops.push_back(o);
+    }
+    if (ops.empty())
+      return extent_protocol::OK;
+
+    unsigned int gen = begin_fetch(s, eid, c);
+    ret = cl(eid)->call(extent_protocol::compound, ops, res);
+    if (!end_fetch(s, c, gen))
+      continue;
+    if (ret == extent_protocol::OK && res.size() != ops.size())
+      ret = extent_protocol::IOERR;
+    for (k = 0; ret == extent_protocol::OK && k < res.size(); ++k)
+      ret = res[k].ret;
+    if (ret != extent_protocol::OK)
+      return ret;
+
+    k = 0;
+    if (need_attr) {
+      if (c.kept && res[0].a.version != c.version)
+        c.pages.clear();
+      c.kept = false;
+      c.attr = res[0].a;
+      c.valid_attr = true;
+      c.attr_expire = 0;
+      k = 1;
+    }
+    if (revalidate) {
+      account(c);
+      dprintf("ec load(%llu): kept copy checked, %u pages stay\n", eid,
+              (uint32_t)c.pages.size());
+      continue;
+    }
+    for (n = 0; n < runs.size(); ++n, ++k) {
+      const std::string &data = res[k].data;
+      for (i = runs[n].first; i <= runs[n].second; ++i) {
+        uint32_t off = (i - runs[n].first) * CACHE_PAGE_SIZE;
+        uint32_t len = page_len(i, c.attr.size);
+        if (len == 0)
+          break;
+        if (c.pages.count(i))
+          continue;
+        // the server's copy may be longer or shorter than ours, if we
+        // changed the size; the difference reads as zeros
+        page &p = c.pages[i];
+        if (off < data.size())
+          p.data = data.substr(off, CACHE_PAGE_SIZE);
+        p.data.resize(len, (char)0);
+      }
+    }
+    account(c);
+    dprintf("ec load(%llu): %u pages in %u runs%s\n", eid, (uint32_t)want.size(),
+            (uint32_t)runs.size(), need_attr ? ", with attr" : "");
+    return extent_protocol::OK;
+  }
+}
+
+// Replace c's pages with buf, all of them clean.
+void
+extent_client::set_contents(cache_content &c, const std::string &buf)
+{
+  c.pages.clear();
+  for (uint32_t i = 0; i < npages(buf.size()); ++i)
+    c.pages[i].data = buf.substr(i * CACHE_PAGE_SIZE, CACHE_PAGE_SIZE);
+}
+
+// Copy the bytes [off, off+len) of c, cut at its end, out of its pages;
+// they must be cached.
+void
+extent_client::contents(const cache_content &c, uint32_t off, uint32_t len,
+                        std::string &buf)
+{
+  std::map<uint32_t, page>::const_iterator it;
+  uint32_t end = c.attr.size;
+
+  buf.clear();
+  if (off >= end)
+    return;
+  if (len < end - off)
+    end = off + len;
+  buf.reserve(end - off);
+  for (uint32_t i = off / CACHE_PAGE_SIZE; i * CACHE_PAGE_SIZE < end; ++i) {
+    it = c.pages.find(i);
+    if (it == c.pages.end())
+      break;
+    uint32_t base = i * CACHE_PAGE_SIZE;
+    uint32_t from = std::max(off, base) - base;
+    uint32_t to = std::min(end - base, (uint32_t)it->second.data.size());
+    if (from < to)
+      buf.append(it->second.data, from, to - from);
+  }
+}
+
+// Change the cached size of c to size. Pages past the new end go; a
+// grown extent reads zeros up to it. The old last page must be cached
+// if the extent grows. Called with the stripe locked.
+void
+extent_client::resize(cache_content &c, uint32_t size)
+{
+  uint32_t old = c.attr.size, i;
+
+  if (size < old) {
+    c.pages.erase(c.pages.lower_bound(npages(size)), c.pages.end());
+    if (size % CACHE_PAGE_SIZE && c.pages.count(size / CACHE_PAGE_SIZE))
+      c.pages[size / CACHE_PAGE_SIZE].data.resize(size % CACHE_PAGE_SIZE);
+  } else {
+    for (i = old / CACHE_PAGE_SIZE; i < npages(size); ++i) {
+      page &p = c.pages[i];
+      uint32_t from = p.data.size();
+      p.data.resize(page_len(i, size), (char)0);
+      p.touch(from, p.data.size());
+    }
+  }
+  c.attr.size = size;
+  c.resized = true;
+  c.dirty = true;
+  c.names.clear();
+}
+
+// Write the len bytes at buf at off into eid's pages. Only the pages it covers in part
+// are fetched first, and the old last page if it grows the extent.
+// Called as load() is.
+extent_protocol::status
+extent_client::write(stripe &s, extent_protocol::extentid_t eid, uint32_t off,
+                     const char *buf, uint32_t len)
+{
+  extent_protocol::status ret;
+  std::vector<uint32_t> want;
+  uint32_t end = off + len;
+  uint32_t first = off / CACHE_PAGE_SIZE, last = end / CACHE_PAGE_SIZE;
+
+  // the server would refuse it at write-back, too late to be reported
+  if ((uint64_t)off + len > MAXFILE * BLOCK_SIZE)
+    return extent_protocol::IOERR;
+  if (off % CACHE_PAGE_SIZE)
+    want.push_back(first);
+  if (end % CACHE_PAGE_SIZE && len > 0 && (want.empty() || last != first))
+    want.push_back(last);
+  if ((ret = load(s, eid, want)) != extent_protocol::OK)
+    return ret;
+
+  cache_content &c = s.entries[eid];
+  if (end > c.attr.size) {
+    if (c.attr.size % CACHE_PAGE_SIZE) {
+      want.assign(1, c.attr.size / CACHE_PAGE_SIZE);
+      if ((ret = load(s, eid, want)) != extent_protocol::OK)
+        return ret;
+    }
+    resize(c, end);
+  }
+  for (uint32_t i = first; i * CACHE_PAGE_SIZE < end; ++i) {
+    uint32_t base = i * CACHE_PAGE_SIZE;
+    uint32_t from = std::max(off, base);
+    uint32_t to = std::min(end, base + CACHE_PAGE_SIZE);
+    page &p = c.pages[i];
+    p.data.replace(from - base, to - from, buf + (from - off), to - from);
+    p.touch(from - base, to - base);
+  }
+  c.dirty = true;
+  c.names.clear();
+  time_t tm = time(NULL);
+  c.attr.mtime = (uint32_t)tm;
+  if (c.attr.type == extent_protocol::T_DIR)
+    c.attr.ctime = (uint32_t)tm;
+  account(c);
+  return extent_protocol::OK;
+}
+
+// Mark bytes from to to of the page dirty, joining the spans it meets.
+void
+extent_client::page::touch(uint32_t from, uint32_t to)
+{
+  std::map<uint32_t, uint32_t>::iterator it;
+
+  if (!dirty)
+    spans.clear();
+  dirty = true;
+  if (from >= to)
+    return;
+  it = spans.upper_bound(from);
+  if (it != spans.begin() && (--it)->second + SPAN_GAP < from)
+    ++it;
+  while (it != spans.end() && it->first <= to + SPAN_GAP) {
+    from = std::min(from, it->first);
+    to = std::max(to, it->second);
+    spans.erase(it++);
+  }
+  spans[from] = to;
+  if (spans.size() > SPANS_MAX) {
+    from = spans.begin()->first;
+    to = spans.rbegin()->second;
+    spans.clear();
+    spans[from] = to;
+  }
+}
+
+// Turn what is dirty in c into steps of a compound RPC, and count it as
+// written back. An extent put as a whole goes back with one put, and so
+// does one cached whole that is mostly dirty; else each run of dirty
+// bytes is a put_range, after a truncate if the size was changed here.
+void
+extent_client::writeback_ops(extent_protocol::extentid_t eid, cache_content &c,
+                             std::vector<extent_protocol::op> &ops)
+{
+  std::map<uint32_t, page>::iterator it;
+  std::map<uint32_t, uint32_t>::iterator sp;
+  extent_protocol::op o;
+  uint32_t next = 0, dirty = 0;
+  bool run = false;
+
+  // a truncate may have cut a span short, or off
+  for (it = c.pages.begin(); it != c.pages.end(); ++it)
+    for (sp = it->second.spans.begin(); it->second.dirty &&
+         sp != it->second.spans.end(); ++sp)
+      if (sp->first < it->second.data.size())
+        dirty += std::min(sp->second, (uint32_t)it->second.data.size()) -
+                 sp->first;
+
+  o.eid = eid;
+  o.off = o.len = 0;
+  if (c.whole || (complete(c) && dirty > c.attr.size / 2)) {
+    o.type = extent_protocol::put;
+    ops.push_back(o);
+    contents(c, 0, c.attr.size, ops.back().data);
+  } else {
+    if (c.resized) {
+      o.type = extent_protocol::truncate;
+      o.off = c.attr.size;
+      ops.push_back(o);
+    }
+    o.type = extent_protocol::put_range;
+    for (it = c.pages.begin(); it != c.pages.end(); ++it) {
+      page &p = it->second;
+      uint32_t base = it->first * CACHE_PAGE_SIZE;
+      for (sp = p.spans.begin(); p.dirty && sp != p.spans.end(); ++sp) {
+        uint32_t hi = std::min(sp->second, (uint32_t)p.data.size());
+        if (sp->first >= hi)
+          continue;
+        if (run && base + sp->first == next) {
+          ops.back().data.append(p.data, sp->first, hi - sp->first);
+        } else {
+          o.off = base + sp->first;
+          ops.push_back(o);
+          ops.back().data.assign(p.data, sp->first, hi - sp->first);
+          run = true;
+        }
+        next = base + hi;
+      }
+    }
+  }
+
+  for (it = c.pages.begin(); it != c.pages.end(); ++it) {
+    it->second.dirty = false;
+    it->second.spans.clear();
+  }
+  c.dirty = c.whole = c.resized = false;
+  account(c, false);
+}
+
+// Bring the byte counts of c, and the cache's, up to date after its
+// pages changed; used marks it for evict(). Called with c's stripe
+// locked; takes mx for the cache's counts.
+void
+extent_client::account(cache_content &c, bool used)
+{
+  std::map<uint32_t, page>::iterator it;
+  uint32_t n = 0, d = 0;
+
+  for (it = c.pages.begin(); it != c.pages.end(); ++it) {
+    n += it->second.data.size();
+    if (it->second.dirty)
+      d += it->second.data.size();
+  }
+  pthread_mutex_lock(&mx);
+  resident_bytes = resident_bytes + n - c.nbytes;
+  dirty_bytes = dirty_bytes + d - c.ndirty;
+  if (flush_bytes > 0 && dirty_bytes > flush_bytes)
+    VERIFY(pthread_cond_signal(&fcv) == 0);
+  pthread_mutex_unlock(&mx);
+  c.nbytes = n;
+  c.ndirty = d;
+  if (used)
+    c.referenced = true;
+  if (!c.dirty)
+    c.dirtied = 0;
+  else if (c.dirtied == 0)
+    c.dirtied = time(NULL);
+}
+
+// Erase an entry, and its bytes from the counts. Called with s.mx held;
+// the entry must not be busy.
+void
+extent_client::forget(stripe &s,
+                      std::map<extent_protocol::extentid_t, cache_content>::iterator it)
+{
+  pthread_mutex_lock(&mx);
+  resident_bytes -= it->second.nbytes;
+  dirty_bytes -= it->second.ndirty;
+  pthread_mutex_unlock(&mx);
+  s.entries.erase(it);
+}
+
+bool
+extent_client::over_budget()
+{
+  bool over;
+
+  pthread_mutex_lock(&mx);
+  over = cache_budget > 0 && resident_bytes > cache_budget;
+  pthread_mutex_unlock(&mx);
+  return over;
+}
+
+// Take s's clock hand once round its entries, while the cache is over
+// budget: one used since the hand last passed has referenced cleared,
+// a clean one is forgotten, kept copies included, and a dirty one is
+// added to dirty. Busy entries are passed over.
+void
+extent_client::sweep(stripe &s, std::vector<extent_protocol::extentid_t> &dirty)
+{
+  std::map<extent_protocol::extentid_t, cache_content>::iterator it;
+
+  pthread_mutex_lock(&s.mx);
+  it = s.entries.upper_bound(s.clock_hand);
+  for (size_t n = s.entries.size(); n > 0 && over_budget(); --n) {
+    if (it == s.entries.end())
+      it = s.entries.begin();
+    s.clock_hand = it->first;
+    cache_content &c = it->second;
+    if (c.busy || c.pinned || !c.ahead.empty()) {
+      ++it;
+    } else if (c.referenced) {
+      c.referenced = false;
+      ++it;
+    } else if (c.dirty) {
+      // a second pass may come by it again
+      if (std::find(dirty.begin(), dirty.end(), it->first) == dirty.end())
+        dirty.push_back(it->first);
+      ++it;
+    } else {
+      forget(s, it++);
+    }
+  }
+  pthread_mutex_unlock(&s.mx);
+}
+
+// Bring the cached pages back under cache_budget, CLOCK fashion, each
+// stripe with a hand of its own: a pass takes every stripe's hand round
+// once, and a second pass takes what the first only marked. If that is
+// not enough, the dirty entries passed are written back and stay cached
+// as clean, for another sweep to take.
+void
+extent_client::evict()
+{
+  std::vector<extent_protocol::extentid_t> dirty;
+  std::vector<bool> written;
+  uint32_t first;
+
+  if (cache_budget == 0)
+    return;
+  for (int round = 0; round < 2; ++round) {
+    dirty.clear();
+    pthread_mutex_lock(&mx);
+    first = next_stripe;
+    next_stripe = (next_stripe + 1) % CACHE_STRIPES;
+    pthread_mutex_unlock(&mx);
+    for (int pass = 0; pass < 2 && over_budget(); ++pass)
+      for (uint32_t k = 0; k < CACHE_STRIPES && over_budget(); ++k)
+        sweep(stripes[(first + k) % CACHE_STRIPES], dirty);
+
+    if (!over_budget() || dirty.empty() || round > 0)
+      break;
+    writeback(dirty, written);
+    dprintf("ec evict: wrote back %u extents\n", (uint32_t)dirty.size());
+  }
+}
+
+// The background flusher. Once a second, or as soon as account() sees
+// dirty_bytes go over flush_bytes, it writes back the extents that have
+// been dirty for flush_age seconds and, oldest first, enough others to
+// bring dirty_bytes down to half of flush_bytes. They stay cached as
+// clean, so a later flush for a revoke has little or nothing to send.
+void
+extent_client::flusher()
+{
+  std::map<extent_protocol::extentid_t, cache_content>::iterator it;
+  // when each dirty extent became dirty, and its dirty bytes
+  std::vector<std::pair<time_t, std::pair<extent_protocol::extentid_t, uint32_t> > > dirty;
+  std::vector<extent_protocol::extentid_t> eids;
+  std::vector<bool> written;
+  struct timespec deadline;
+  struct timeval now;
+
+  pthread_mutex_lock(&mx);
+  while (!stopping) {
+    // a signal sent while we were writing back is not waited for again
+    if (flush_bytes == 0 || dirty_bytes <= flush_bytes) {
+      gettimeofday(&now, NULL);
+      deadline.tv_sec = now.tv_sec + 1;
+      deadline.tv_nsec = now.tv_usec * 1000;
+      pthread_cond_timedwait(&fcv, &mx, &deadline);
+    }
+    if (stopping)
+      break;
+    uint64_t left = dirty_bytes;
+    pthread_mutex_unlock(&mx);
+
+    dirty.clear();
+    for (uint32_t k = 0; k < CACHE_STRIPES; ++k) {
+      stripe &s = stripes[k];
+      pthread_mutex_lock(&s.mx);
+      for (it = s.entries.begin(); it != s.entries.end(); ++it)
+        if (it->second.dirty)
+          dirty.push_back(std::make_pair(it->second.dirtied,
+                                         std::make_pair(it->first, it->second.ndirty)));
+      pthread_mutex_unlock(&s.mx);
+    }
+    std::sort(dirty.begin(), dirty.end());
+
+    time_t t = time(NULL);
+    bool over = flush_bytes > 0 && left > flush_bytes;
+    eids.clear();
+    for (uint32_t i = 0; i < dirty.size(); ++i) {
+      if (!(flush_age > 0 && t - dirty[i].first >= flush_age) &&
+          !(over && left > flush_bytes / 2))
+        break;
+      eids.push_back(dirty[i].second.first);
+      left -= dirty[i].second.second;
+    }
+
+    writeback(eids, written);
+    if (!eids.empty())
+      dprintf("ec flusher: wrote back %u extents\n", (uint32_t)eids.size());
+    pthread_mutex_lock(&mx);
+  }
+  pthread_mutex_unlock(&mx);
+}
+
+void
+extent_client::usage(uint64_t &resident, uint64_t &dirty)
+{
+  pthread_mutex_lock(&mx);
+  resident = resident_bytes;
+  dirty = dirty_bytes;
+  pthread_mutex_unlock(&mx);
 }
 
 // a demo to show how to use RPC
@@ -29,59 +855,116 @@ extent_client::getattr(extent_protocol::extentid_t eid,
 		       extent_protocol::attr &attr)
 {
   extent_protocol::status ret = extent_protocol::OK;
-  pthread_mutex_lock(&mx);
-  if (extent_cache.find(eid) == extent_cache.end()) {
-    extent_cache[eid].dirty = false;
-    extent_cache[eid].valid_buf = false;
-    extent_cache[eid].valid_attr = false;
+  stripe &s = stripe_of(eid);
+  pthread_mutex_lock(&s.mx);
+  if (s.entries.find(eid) == s.entries.end()) {
     dprintf("ec getattr(%llu), first time\n", eid);
   }
+  cache_content &c = entry(s, eid);
 
-  if (!extent_cache[eid].valid_attr) {
-    ret = cl->call(extent_protocol::getattr, eid, attr);
-    extent_cache[eid].attr = attr;
-    extent_cache[eid].valid_attr = true;
+  while (ret == extent_protocol::OK && !attr_valid(c)) {
+    extent_protocol::attr a;
+    unsigned int gen = begin_fetch(s, eid, c);
+    ret = cl(eid)->call(extent_protocol::getattr, eid, a);
+    if (!end_fetch(s, c, gen)) {
+      ret = extent_protocol::OK;
+      continue;
+    }
+    if (ret == extent_protocol::OK) {
+      if (c.kept) {
+        // nobody changed it while we did not hold the lock, or somebody did
+        if (a.version != c.version)
+          c.pages.clear();
+        c.kept = false;
+      }
+      c.attr = a;
+      c.valid_attr = true;
+      c.attr_expire = 0;
+      account(c);
+    }
     dprintf("ec getattr(%llu), not valid, ask server...\n", eid);
   }
-  else {
-    //attr is cached~
-    attr = extent_cache[eid].attr;
-  }
-  pthread_mutex_unlock(&mx);
+  //attr is cached~
+  if (ret == extent_protocol::OK)
+    attr = c.attr;
+  pthread_mutex_unlock(&s.mx);
 
   dprintf("zzz: ec: getattr eid(%llu)\n", eid);
   return ret;
 }
 
+// Start a cache entry for an extent create_v2 just made, with the
+// server's attributes. The caller takes the new extent's lock before
+// the extent can be reached by name, so they are treated as lock-backed.
+void
+extent_client::created(const extent_protocol::result &r)
+{
+  stripe &s = stripe_of(r.eid);
+  pthread_mutex_lock(&s.mx);
+  wait_idle(s, r.eid);
+  if (s.entries.find(r.eid) != s.entries.end())
+    forget(s, s.entries.find(r.eid));
+  cache_content &c = s.entries[r.eid];
+  c.attr = r.a;
+  c.valid_attr = true;
+  pthread_mutex_unlock(&s.mx);
+}
+
 extent_protocol::status
 extent_client::create(uint32_t type, extent_protocol::extentid_t &id)
 {
   extent_protocol::status ret = extent_protocol::OK;
-  ret = cl->call(extent_protocol::create, type, id);
+  extent_protocol::result r;
+  // new extents go to the shards in turn; a full shard is skipped
   pthread_mutex_lock(&mx);
-  if (extent_cache.find(id) == extent_cache.end()) {
-    extent_cache[id].dirty = false;
-    extent_cache[id].valid_buf = false;
-    extent_cache[id].valid_attr = false;
-    dprintf("ec create(%llu), first time\n", id);
+  uint32_t s = next_shard;
+  next_shard = (next_shard + 1) % cls.size();
+  pthread_mutex_unlock(&mx);
+  for (uint32_t i = 0; i < cls.size(); ++i) {
+    ret = cls[(s + i) % cls.size()]->call(extent_protocol::create_v2, type,
+                                         (extent_protocol::extentid_t)0,
+                                         std::string(), r);
+    if (ret != extent_protocol::IOERR)
+      break;
   }
+  if (ret != extent_protocol::OK)
+    return ret;
+  id = r.eid;
+  created(r);
 
-  time_t tm = time(NULL);
-  extent_cache[id].attr.type = type;
-  extent_cache[id].attr.mtime = (uint32_t)tm;
-  extent_cache[id].attr.ctime = (uint32_t)tm;
+  dprintf("zzz: ec: create eid(%llu) type(%u) valid_attr\n", id, type);
+  return ret;
+}
 
-  // values not updated
-  extent_cache[id].attr.atime = 0;
-  extent_cache[id].buf = "";
-  extent_cache[id].attr.size = 0;
-  //extent_cache[id].valid_attr = false;
-  //extent_cache[id].valid_buf = false;
+// Create an extent and link it into parent as name in one RPC. Files are
+// placed on their parent's shard for that; directories still go to the
+// shards in turn, and so does a file whose parent's shard is full, at
+// the price of a separate dir_add. EXIST returns the inum already there.
+extent_protocol::status
+extent_client::create(uint32_t type, extent_protocol::extentid_t parent,
+                      std::string name, extent_protocol::extentid_t &id)
+{
+  extent_protocol::status ret;
+  extent_protocol::result r;
 
-  pthread_mutex_unlock(&mx);
+  if (type == extent_protocol::T_FILE || cls.size() == 1) {
+    dir_writeback(parent, true);
+    ret = cl(parent)->call(extent_protocol::create_v2, type, parent, name, r);
+    unname(parent);
+    if (ret == extent_protocol::OK)
+      created(r);
+    if (ret == extent_protocol::OK || ret == extent_protocol::EXIST)
+      id = r.eid;
+    if (ret != extent_protocol::IOERR || cls.size() == 1)
+      return ret;
+  }
 
-  dprintf("zzz: ec: create eid(%llu) type(%u) valid_attr\n", id, type);
-  // Your lab3 code goes here
+  ret = create(type, id);
+  if (ret != extent_protocol::OK)
+    return ret;
+  ret = dir_add(parent, name, id);
+  if (ret != extent_protocol::OK)
+    remove(id);
   return ret;
 }
 
@@ -89,76 +972,102 @@ extent_protocol::status
 extent_client::get(extent_protocol::extentid_t eid, std::string &buf)
 {
   extent_protocol::status ret = extent_protocol::OK;
-  pthread_mutex_lock(&mx);
-  if (extent_cache.find(eid) == extent_cache.end()) {
-    extent_cache[eid].dirty = false;
-    extent_cache[eid].valid_buf = false;
-    extent_cache[eid].valid_attr = false;
+  stripe &s = stripe_of(eid);
+  pthread_mutex_lock(&s.mx);
+  if (s.entries.find(eid) == s.entries.end()) {
     dprintf("ec get(%llu), first time\n", eid);
   }
+  cache_content &c = entry(s, eid);
 
-  if (!extent_cache[eid].valid_buf) {
-    ret = cl->call(extent_protocol::get, eid, buf);
-    extent_cache[eid].buf = buf;
-    extent_cache[eid].valid_buf = true;
-    dprintf("ec get(%llu), not valid, ask server...\n", eid);
-  }
-  else {
+  if (complete(c)) {
     //buf is cached~
-    buf = extent_cache[eid].buf;
-    time_t tm = time(NULL);
-    extent_cache[eid].attr.atime = (uint32_t)tm;
+    contents(c, 0, c.attr.size, buf);
+    c.attr.atime = (uint32_t)time(NULL);
+    c.referenced = true;
+    pthread_mutex_unlock(&s.mx);
+    return ret;
   }
-  pthread_mutex_unlock(&mx);
+
+  if (c.dirty) {
+    // written here in part; only the pages not cached yet are fetched
+    std::vector<uint32_t> want;
+    for (uint32_t i = 0; i < npages(c.attr.size); ++i)
+      want.push_back(i);
+    ret = load(s, eid, want);
+  } else {
+    // fetch the attr along with the content, so a getattr that
+    // usually follows does not cost another round trip; a whole copy
+    // kept from before a revoke is only sent again if it has changed
+    extent_protocol::result r;
+    bool whole;
+    do {
+      whole = c.kept && c.pages.size() == npages(c.attr.size);
+      unsigned int gen = begin_fetch(s, eid, c);
+      ret = cl(eid)->call(extent_protocol::get_if_changed, eid,
+                          whole ? c.version : 0, r);
+      if (end_fetch(s, c, gen))
+        break;
+    } while (true);
+    if (ret == extent_protocol::NOTMODIFIED) {
+      ret = extent_protocol::OK;
+      dprintf("ec get(%llu), kept copy still current\n", eid);
+    } else if (ret == extent_protocol::OK) {
+      set_contents(c, r.data);
+    }
+    if (ret == extent_protocol::OK) {
+      c.kept = false;
+      c.attr = r.a;
+      c.valid_attr = true;
+      c.attr_expire = 0;
+    }
+    dprintf("ec get(%llu), not valid, ask server...\n", eid);
+  }
+  if (ret == extent_protocol::OK)
+    contents(c, 0, c.attr.size, buf);
+  account(c);
+  pthread_mutex_unlock(&s.mx);
+  evict();
   dprintf("ec get(%llu) get_buf_sz(%u)\n", eid, buf.size());
   // Your lab3 code goes here
   return ret;
 }
 
 extent_protocol::status
-extent_client::put(extent_protocol::extentid_t eid, std::string buf)
+extent_client::put(extent_protocol::extentid_t eid, const std::string &buf)
 {
   extent_protocol::status ret = extent_protocol::OK;
-  pthread_mutex_lock(&mx);
-  //int tmp;
-  if (extent_cache.find(eid) == extent_cache.end()) {
-    extent_cache[eid].dirty = false;
-    extent_cache[eid].valid_buf = false;
-    extent_cache[eid].valid_attr = false;
+  write_lease(eid);
+  stripe &s = stripe_of(eid);
+  pthread_mutex_lock(&s.mx);
+  if (s.entries.find(eid) == s.entries.end()) {
     dprintf("ec put(%llu), first time\n", eid);
   }
+  cache_content &c = entry(s, eid);
 
-  // (uncached) put may change both buf & attr
-  // extent_cache[eid].valid_buf = false;
-  // extent_cache[eid].valid_attr = false;
-  
-  //if (!extent_cache[eid].valid_buf) {
-    //ret = cl->call(extent_protocol::get, eid, buf);
-    //extent_cache[eid].buf = buf;
-    //extent_cache[eid].valid = true;
-    //dprintf("ec put(%llu), not valid buf, ask server (SHOULD NOT HAPPEN!)...\n", eid);
-    //extent_cache[eid].buf = buf;
-  //}
-  //else {
-    // put -> es.put -> im.write_file; this may cause attr changes, but since we cache it on ec side,
-    //  modification on attr only needs to be applied the last time since ec writes back (does RPC
-    //  call to server), and the attr logic is still hold by im, so no need to bother attr here.
-    //extent_cache[eid].buf = buf;
-  //}
-  extent_cache[eid].buf = buf;
-  extent_cache[eid].dirty = true;
+  // put -> es.put -> im.write_file; the cached attr stands for the
+  // server's until the write-back, so it is fetched first if need be
+  if (!size_known(c))
+    load(s, eid, std::vector<uint32_t>());
+  set_contents(c, buf);
+  for (std::map<uint32_t, page>::iterator it = c.pages.begin();
+       it != c.pages.end(); ++it)
+    it->second.touch(0, it->second.data.size());
+  c.kept = false;
+  c.whole = true;
+  c.dirty = true;
+  c.names.clear();
   time_t tm = time(NULL);
-  extent_cache[eid].attr.mtime = (uint32_t)tm;
-  if (extent_cache[eid].attr.type == extent_protocol::T_DIR)
-    extent_cache[eid].attr.ctime = (uint32_t)tm;
-  extent_cache[eid].attr.size = buf.size();
-  extent_cache[eid].valid_buf = true;
-  //extent_cache[eid].valid_attr = true;
-  
-  pthread_mutex_unlock(&mx);
+  c.attr.mtime = (uint32_t)tm;
+  if (c.attr.type == extent_protocol::T_DIR)
+    c.attr.ctime = (uint32_t)tm;
+  c.attr.size = buf.size();
+  c.valid_attr = true;
+  c.attr_expire = 0;
+  account(c);
+  pthread_mutex_unlock(&s.mx);
+  evict();
 
-  dprintf("ec put(%llu) strsz(%u)%s\n", eid, buf.size(), buf.c_str());
-  //ret = cl->call(extent_protocol::put, eid, buf, tmp);
+  dprintf("ec put(%llu) strsz(%u)\n", eid, buf.size());
   // Your lab3 code goes here
   return ret;
 }
@@ -167,13 +1076,17 @@ extent_protocol::status
 extent_client::remove(extent_protocol::extentid_t eid)
 {
   extent_protocol::status ret = extent_protocol::OK;
-  pthread_mutex_lock(&mx);
+  stripe &s = stripe_of(eid);
+  pthread_mutex_lock(&s.mx);
 
 //if REMOVE_WRITE_BACK
   dprintf("ZZZ REMOVE HELLO!\n");
   int tmp;
-  extent_cache.erase(eid);
-  ret = cl->call(extent_protocol::remove, eid, tmp);
+  wait_idle(s, eid);
+  if (s.entries.find(eid) != s.entries.end())
+    forget(s, s.entries.find(eid));
+  pthread_mutex_unlock(&s.mx);
+  ret = cl(eid)->call(extent_protocol::remove, eid, tmp);
 #if 0
   //NOT USING REMOTE_WRITE_BACK
   // cache for eid is no longer valid since it is removed
@@ -188,31 +1101,546 @@ extent_client::remove(extent_protocol::extentid_t eid)
   //extent_cache.erase(eid);
 #endif
 
-  pthread_mutex_unlock(&mx);
   dprintf("zzz: ec: remove eid(%llu)\n", eid);
   // Your lab3 code goes here
   return ret;
 }
 
+// Ranged operations only touch the pages involved. Pages a read needs
+// and a write covers in part are fetched with get_range first, along
+// with the attr if it is not cached; a write covering whole pages
+// fetches nothing.
 extent_protocol::status
-extent_client::flush(extent_protocol::extentid_t eid)
+extent_client::get_range(extent_protocol::extentid_t eid, uint32_t off,
+                         uint32_t len, std::string &buf)
+{
+  extent_protocol::status ret;
+  std::vector<uint32_t> want;
+  uint64_t end = (uint64_t)off + len;
+
+  stripe &s = stripe_of(eid);
+  pthread_mutex_lock(&s.mx);
+  cache_content &c = entry(s, eid);
+  if (size_known(c) && end > c.attr.size)
+    end = c.attr.size;
+  for (uint64_t i = off / CACHE_PAGE_SIZE; i * CACHE_PAGE_SIZE < end; ++i)
+    want.push_back((uint32_t)i);
+  ret = load(s, eid, want);
+  if (ret == extent_protocol::OK) {
+    contents(c, off, len, buf);
+    c.attr.atime = (uint32_t)time(NULL);
+    read_ahead(eid, c, off, off + buf.size());
+  }
+  c.referenced = true;
+  pthread_mutex_unlock(&s.mx);
+  evict();
+  dprintf("ec get_range(%llu) off(%u) len(%u)\n", eid, off, len);
+  return ret;
+}
+
+// Sequential reads of an extent, each starting where the last one
+// ended, open a read-ahead window of RA_MIN_WINDOW pages and double it
+// on every read, up to ra_max; any other read closes it. Once a read
+// comes within half a window of what has been asked for ahead, the
+// next window is queued for prefetcher(). Called with c's stripe locked.
+void
+extent_client::read_ahead(extent_protocol::extentid_t eid, cache_content &c,
+                          uint32_t off, uint32_t end)
+{
+  ra_req r;
+
+  if (ra_max == 0)
+    return;
+  if (off != c.ra_next || c.kept || !size_known(c)) {
+    c.ra_window = c.ra_end = 0;
+    c.ra_next = end;
+    return;
+  }
+  c.ra_next = end;
+  c.ra_window = std::min<uint32_t>(c.ra_window ? 2 * c.ra_window : RA_MIN_WINDOW,
+                                   ra_max);
+  if (c.ra_end > npages(end) + c.ra_window / 2)
+    return;
+  r.eid = eid;
+  r.first = std::max(c.ra_end, npages(end));
+  c.ra_end = std::min(npages(end) + c.ra_window, npages(c.attr.size));
+  if (r.first >= c.ra_end)
+    return;
+  r.n = c.ra_end - r.first;
+
+  pthread_mutex_lock(&mx);
+  // past that the reader will be there first and read the pages itself
+  if (ra_queue.size() < RA_MAX_QUEUED) {
+    ra_queue.push_back(r);
+    VERIFY(pthread_cond_signal(&racv) == 0);
+  }
+  pthread_mutex_unlock(&mx);
+}
+
+// Read pages [first, first+n) of eid ahead into its cached copy: those
+// not cached nor on their way already, in one compound RPC. Nothing is
+// read if the window has been closed since, if the copy is no longer
+// one read under the lock or a lease, or if a fetch or a write-back of
+// it is under way. Pages on their way are in ahead, which keeps the
+// entry from being dropped, and which load() waits on.
+void
+extent_client::prefetch(extent_protocol::extentid_t eid, uint32_t first, uint32_t n)
+{
+  std::map<extent_protocol::extentid_t, cache_content>::iterator it;
+  std::vector<std::pair<uint32_t, uint32_t> > runs;
+  std::vector<extent_protocol::op> ops;
+  std::vector<extent_protocol::result> res;
+  extent_protocol::status ret;
+  extent_protocol::op o;
+  stripe &s = stripe_of(eid);
+  uint32_t i, k;
+
+  pthread_mutex_lock(&s.mx);
+  it = s.entries.find(eid);
+  if (it == s.entries.end() || it->second.busy || s.writing.count(eid) ||
+      it->second.ra_window == 0 || it->second.kept || !size_known(it->second)) {
+    pthread_mutex_unlock(&s.mx);
+    return;
+  }
+  cache_content &c = it->second;
+  for (i = first; i < first + n && i < npages(c.attr.size); ++i) {
+    if (c.pages.count(i) || c.ahead.count(i))
+      continue;
+    c.ahead.insert(i);
+    if (!runs.empty() && runs.back().second + 1 == i)
+      runs.back().second = i;
+    else
+      runs.push_back(std::make_pair(i, i));
+  }
+  if (runs.empty()) {
+    pthread_mutex_unlock(&s.mx);
+    return;
+  }
+  o.eid = eid;
+  o.type = extent_protocol::get_range;
+  for (k = 0; k < runs.size(); ++k) {
+    o.off = runs[k].first * CACHE_PAGE_SIZE;
+    o.len = (runs[k].second - runs[k].first + 1) * CACHE_PAGE_SIZE;
+    ops.push_back(o);
+  }
+  unsigned int gen = c.gen;
+  pthread_mutex_unlock(&s.mx);
+
+  ret = cl(eid)->call(extent_protocol::compound, ops, res);
+
+  pthread_mutex_lock(&s.mx);
+  if (ret == extent_protocol::OK && res.size() == ops.size() &&
+      c.gen == gen && !c.kept && size_known(c)) {
+    for (k = 0; k < runs.size(); ++k) {
+      const std::string &data = res[k].data;
+      if (res[k].ret != extent_protocol::OK)
+        continue;
+      for (i = runs[k].first; i <= runs[k].second; ++i) {
+        uint32_t off = (i - runs[k].first) * CACHE_PAGE_SIZE;
+        uint32_t len = page_len(i, c.attr.size);
+        // written, or cut off by a truncate, while we were away
+        if (len == 0 || c.pages.count(i))
+          continue;
+        page &p = c.pages[i];
+        if (off < data.size())
+          p.data = data.substr(off, CACHE_PAGE_SIZE);
+        p.data.resize(len, (char)0);
+      }
+    }
+    account(c, false);
+  }
+  for (k = 0; k < runs.size(); ++k)
+    for (i = runs[k].first; i <= runs[k].second; ++i)
+      c.ahead.erase(i);
+  VERIFY(pthread_cond_broadcast(&s.cv) == 0);
+  pthread_mutex_unlock(&s.mx);
+  evict();
+  dprintf("ec prefetch(%llu): pages %u-%u\n", eid, first, first + n - 1);
+}
+
+// The read-ahead thread, taking the windows read_ahead() queues in turn.
+void
+extent_client::prefetcher()
+{
+  ra_req r;
+
+  pthread_mutex_lock(&mx);
+  while (true) {
+    while (!stopping && ra_queue.empty())
+      VERIFY(pthread_cond_wait(&racv, &mx) == 0);
+    if (stopping)
+      break;
+    r = ra_queue.front();
+    ra_queue.pop_front();
+    pthread_mutex_unlock(&mx);
+
+    prefetch(r.eid, r.first, r.n);
+    pthread_mutex_lock(&mx);
+  }
+  pthread_mutex_unlock(&mx);
+}
+
+extent_protocol::status
+extent_client::put_range(extent_protocol::extentid_t eid, uint32_t off,
+                         const std::string &buf)
+{
+  return put_range(eid, off, buf.data(), buf.size());
+}
+
+// put_range straight from the caller's buffer, which is copied only
+// into the cached pages.
+extent_protocol::status
+extent_client::put_range(extent_protocol::extentid_t eid, uint32_t off,
+                         const char *buf, uint32_t len)
+{
+  extent_protocol::status ret;
+  write_lease(eid);
+  stripe &s = stripe_of(eid);
+  pthread_mutex_lock(&s.mx);
+  entry(s, eid);
+  ret = write(s, eid, off, buf, len);
+  pthread_mutex_unlock(&s.mx);
+  evict();
+  dprintf("ec put_range(%llu) off(%u) len(%u)\n", eid, off, len);
+  return ret;
+}
+
+// Add buf at the end of the extent; off is where it went. Without a
+// cached size only buf is sent, and the server's attributes come back.
+extent_protocol::status
+extent_client::append(extent_protocol::extentid_t eid, const std::string &buf,
+                      uint32_t &off)
 {
   extent_protocol::status ret = extent_protocol::OK;
-  std::string buf;
+  extent_protocol::attr a;
+  write_lease(eid);
+  stripe &s = stripe_of(eid);
+  pthread_mutex_lock(&s.mx);
+  cache_content &c = entry(s, eid);
+  if (size_known(c)) {
+    off = c.attr.size;
+    ret = write(s, eid, off, buf.data(), buf.size());
+    pthread_mutex_unlock(&s.mx);
+    evict();
+    return ret;
+  }
+  // a kept copy's last page would be out of date
+  c.pages.clear();
+  c.kept = false;
+  account(c);
+
+  unsigned int gen = begin_fetch(s, eid, c);
+  ret = cl(eid)->call(extent_protocol::append, eid, buf, a);
+  bool current = end_fetch(s, c, gen);
+  if (ret == extent_protocol::OK) {
+    off = a.size - buf.size();
+    c.attr = a;
+    c.valid_attr = current;
+    c.attr_expire = 0;
+  } else {
+    c.valid_attr = false;
+  }
+  pthread_mutex_unlock(&s.mx);
+  dprintf("ec append(%llu) len(%u), size not cached, ask server...\n", eid, buf.size());
+  return ret;
+}
+
+extent_protocol::status
+extent_client::truncate(extent_protocol::extentid_t eid, uint32_t size)
+{
+  extent_protocol::status ret;
+  std::vector<uint32_t> want;
+  if (size > MAXFILE * BLOCK_SIZE)
+    return extent_protocol::IOERR;
+  write_lease(eid);
+  stripe &s = stripe_of(eid);
+  pthread_mutex_lock(&s.mx);
+  cache_content &c = entry(s, eid);
+  ret = load(s, eid, want);
+  if (ret == extent_protocol::OK && size > c.attr.size &&
+      c.attr.size % CACHE_PAGE_SIZE) {
+    want.push_back(c.attr.size / CACHE_PAGE_SIZE);
+    ret = load(s, eid, want);
+  }
+  if (ret == extent_protocol::OK) {
+    if (size != c.attr.size)
+      resize(c, size);
+    c.attr.mtime = (uint32_t)time(NULL);
+  }
+  account(c);
+  pthread_mutex_unlock(&s.mx);
+  dprintf("ec truncate(%llu) size(%u)\n", eid, size);
+  return ret;
+}
+
+// Directory entries are looked up in the cached copy if there is one;
+// otherwise, and for every change, only the entry involved crosses the
+// network.
+extent_protocol::status
+extent_client::dir_lookup(extent_protocol::extentid_t parent, std::string name,
+                          extent_protocol::extentid_t &ino)
+{
+  extent_protocol::status ret = extent_protocol::NOENT;
+  std::map<extent_protocol::extentid_t, cache_content>::iterator it;
+  std::map<uint32_t, page>::iterator pit;
+  std::string n;
+  uint32_t inum;
+
+  ino = 0;
+  stripe &s = stripe_of(parent);
+  pthread_mutex_lock(&s.mx);
+  it = s.entries.find(parent);
+  if (it != s.entries.end() && !complete(it->second) &&
+      it->second.names.count(name) &&
+      it->second.names[name].second > time(NULL)) {
+    // looked up before, under the lock or a lease still held
+    it->second.referenced = true;
+    ino = it->second.names[name].first;
+    pthread_mutex_unlock(&s.mx);
+    return ino != 0 ? extent_protocol::OK : extent_protocol::NOENT;
+  }
+  if (it != s.entries.end() && complete(it->second)) {
+    it->second.referenced = true;
+    // slots do not span pages; see CACHE_PAGE_SIZE
+    for (pit = it->second.pages.begin(); pit != it->second.pages.end(); ++pit) {
+      const std::string &buf = pit->second.data;
+      for (uint32_t off = 0; off + DIRENT_SIZE <= buf.size(); off += DIRENT_SIZE) {
+        inum = dirent_unpack(buf.data() + off, n);
+        if (inum != 0 && n == name) {
+          ino = inum;
+          ret = extent_protocol::OK;
+          break;
+        }
+      }
+      if (ret == extent_protocol::OK)
+        break;
+    }
+    pthread_mutex_unlock(&s.mx);
+    return ret;
+  }
+  // the server's copy may be on its way there
+  while (s.writing.count(parent))
+    VERIFY(pthread_cond_wait(&s.cv, &s.mx) == 0);
+  cache_content &c = s.entries[parent];
+  unsigned int gen = c.gen;
+  c.pinned++;
+  pthread_mutex_unlock(&s.mx);
+
+  ret = cl(parent)->call(extent_protocol::dir_lookup, parent, name, ino);
+
+  // remember the answer, found or not, unless a callback came meanwhile
+  pthread_mutex_lock(&s.mx);
+  c.pinned--;
+  VERIFY(pthread_cond_broadcast(&s.cv) == 0);
+  if (lookup_ttl > 0 && c.gen == gen &&
+      (ret == extent_protocol::OK || ret == extent_protocol::NOENT)) {
+    if (c.names.size() >= LOOKUP_NAMES_MAX)
+      c.names.clear();
+    c.names[name] = std::make_pair(ret == extent_protocol::OK ? ino : 0,
+                                   time(NULL) + lookup_ttl);
+  }
+  pthread_mutex_unlock(&s.mx);
+  dprintf("ec dir_lookup(%llu, %s), not cached, ask server...\n", parent, name.c_str());
+  return ret;
+}
+
+// The server picks the slot, so a cached copy of the directory cannot be
+// patched; write it back first if needed and drop it. The stripe is not
+// locked over the write-back, which may call invalidate_handler back.
+void
+extent_client::dir_writeback(extent_protocol::extentid_t parent, bool drop)
+{
+  std::map<extent_protocol::extentid_t, cache_content>::iterator it;
+  std::vector<extent_protocol::op> ops;
+  std::vector<extent_protocol::result> res;
+  stripe &s = stripe_of(parent);
+
+  pthread_mutex_lock(&s.mx);
+  wait_idle(s, parent);
+  it = s.entries.find(parent);
+  if (it != s.entries.end() && it->second.dirty) {
+    writeback_ops(parent, it->second, ops);
+    s.writing.insert(parent);
+  }
+  pthread_mutex_unlock(&s.mx);
+
+  if (!ops.empty()) {
+    cl(parent)->call(extent_protocol::compound, ops, res);
+    pthread_mutex_lock(&s.mx);
+    s.writing.erase(parent);
+    VERIFY(pthread_cond_broadcast(&s.cv) == 0);
+    pthread_mutex_unlock(&s.mx);
+  }
+
+  if (drop) {
+    pthread_mutex_lock(&s.mx);
+    wait_idle(s, parent);
+    if (s.entries.find(parent) != s.entries.end())
+      forget(s, s.entries.find(parent));
+    pthread_mutex_unlock(&s.mx);
+  }
+}
+
+extent_protocol::status
+extent_client::dir_add(extent_protocol::extentid_t parent, std::string name,
+                       extent_protocol::extentid_t ino)
+{
   int tmp;
-  pthread_mutex_lock(&mx);
+
+  dir_writeback(parent, true);
+  dprintf("ec dir_add(%llu, %s, %llu)\n", parent, name.c_str(), ino);
+  extent_protocol::status ret =
+    cl(parent)->call(extent_protocol::dir_add, parent, name, ino, tmp);
+  unname(parent);
+  return ret;
+}
+
+extent_protocol::status
+extent_client::dir_remove(extent_protocol::extentid_t parent, std::string name,
+                          extent_protocol::extentid_t &ino)
+{
+  dir_writeback(parent, true);
+  dprintf("ec dir_remove(%llu, %s)\n", parent, name.c_str());
+  extent_protocol::status ret =
+    cl(parent)->call(extent_protocol::dir_remove, parent, name, ino);
+  unname(parent);
+  return ret;
+}
+
+// The server changed parent's entries: forget the lookups remembered
+// for it, and any that were under way when it did.
+void
+extent_client::unname(extent_protocol::extentid_t parent)
+{
+  stripe &s = stripe_of(parent);
+  pthread_mutex_lock(&s.mx);
+  std::map<extent_protocol::extentid_t, cache_content>::iterator it =
+    s.entries.find(parent);
+  if (it != s.entries.end()) {
+    it->second.names.clear();
+    it->second.gen++;
+  }
+  pthread_mutex_unlock(&s.mx);
+}
+
+// Fetch a directory listing with every entry's attributes and use them
+// to fill the attribute cache. The caller holds the directory's lock but
+// not the entries', so those attributes are only kept for a short while
+// unless the entry's own lock is taken and they are refreshed.
+extent_protocol::status
+extent_client::readdir_plus(extent_protocol::extentid_t dir,
+                            std::vector<extent_protocol::dirent_plus> &ents)
+{
+  extent_protocol::status ret;
+  std::map<extent_protocol::extentid_t, cache_content>::iterator it;
+  time_t expire;
+
+  dir_writeback(dir, false);
+  ret = cl(dir)->call(extent_protocol::readdir_plus, dir, ents);
+  if (ret != extent_protocol::OK)
+    return ret;
+
+  // entries on other shards come back with type 0; ask each of those
+  // shards for their attributes in one compound RPC
+  if (cls.size() > 1) {
+    std::vector<std::vector<extent_protocol::op> > ops(cls.size());
+    std::vector<std::vector<uint32_t> > idx(cls.size());
+    std::vector<extent_protocol::result> res;
+    for (uint32_t i = 0; i < ents.size(); ++i) {
+      if (ents[i].a.type != 0)
+        continue;
+      extent_protocol::op o;
+      o.type = extent_protocol::getattr;
+      o.eid = ents[i].inum;
+      o.off = o.len = 0;
+      ops[shard_of(o.eid)].push_back(o);
+      idx[shard_of(o.eid)].push_back(i);
+    }
+    for (uint32_t s = 0; s < cls.size(); ++s) {
+      if (ops[s].empty())
+        continue;
+      res.clear();
+      ret = cls[s]->call(extent_protocol::compound, ops[s], res);
+      if (ret != extent_protocol::OK)
+        return ret;
+      for (uint32_t i = 0; i < res.size() && i < idx[s].size(); ++i)
+        ents[idx[s][i]].a = res[i].a;
+    }
+  }
+
+  if (attr_ttl == 0)
+    return ret;
+  expire = time(NULL) + attr_ttl;
+  for (uint32_t i = 0; i < ents.size(); ++i) {
+    stripe &s = stripe_of(ents[i].inum);
+    pthread_mutex_lock(&s.mx);
+    it = s.entries.find(ents[i].inum);
+    if (it == s.entries.end() || !it->second.valid_attr ||
+        it->second.attr_expire != 0) {
+      // else held under the extent's own lock, and may be newer
+      cache_content &c = s.entries[ents[i].inum];
+      c.attr = ents[i].a;
+      c.valid_attr = true;
+      c.attr_expire = expire;
+    }
+    pthread_mutex_unlock(&s.mx);
+  }
+  dprintf("ec readdir_plus(%llu): %u entries\n", dir, ents.size());
+  return ret;
+}
+
+// Forget an extent whose lock is going away, after any write-back. A
+// clean copy stays behind, marked kept, to be checked against the
+// server's version before it is used again; anything else is dropped.
+void
+extent_client::drop(stripe &s,
+                    std::map<extent_protocol::extentid_t, cache_content>::iterator it)
+{
+  cache_content &c = it->second;
+
+  if (c.dirty || (!c.kept && (c.pages.empty() || !size_known(c)))) {
+    forget(s, it);
+    return;
+  }
+  if (!c.kept)
+    c.version = c.attr.version;
+  c.valid_attr = false;
+  c.attr_expire = 0;
+  c.kept = true;
+  c.names.clear();
+}
+
+extent_protocol::status
+extent_client::flush(extent_protocol::extentid_t eid)
+{
+  extent_protocol::status ret = extent_protocol::OK;
+  std::vector<extent_protocol::op> ops;
+  std::vector<extent_protocol::result> res;
+  std::map<extent_protocol::extentid_t, cache_content>::iterator it;
+  stripe &s = stripe_of(eid);
+  pthread_mutex_lock(&s.mx);
+  wait_idle(s, eid);
   // if eid is removed, cannot find eid since it was erased
-  if (extent_cache.find(eid) == extent_cache.end()) {
+  if (s.entries.find(eid) == s.entries.end()) {
     // removed or wrong eid input
-    pthread_mutex_unlock(&mx);
+    pthread_mutex_unlock(&s.mx);
     return ret;
   }
 
-  dprintf("ec flush(%llu), eid type:%u\n", eid, extent_cache[eid].attr.type);
-  if (extent_cache[eid].dirty) {
-    buf = extent_cache[eid].buf;
-    ret = cl->call(extent_protocol::put, eid, buf, tmp);
-    dprintf("ec flush(%llu), dirty ask server put RPC...\n", eid);
+  dprintf("ec flush(%llu), eid type:%u\n", eid, s.entries[eid].attr.type);
+  if (s.entries[eid].dirty) {
+    // only the dirty pages go back, in one compound RPC
+    writeback_ops(eid, s.entries[eid], ops);
+    s.writing.insert(eid);
+    pthread_mutex_unlock(&s.mx);
+    ret = cl(eid)->call(extent_protocol::compound, ops, res);
+    for (uint32_t i = 0; ret == extent_protocol::OK && i < res.size(); ++i)
+      ret = res[i].ret;
+    pthread_mutex_lock(&s.mx);
+    s.writing.erase(eid);
+    VERIFY(pthread_cond_broadcast(&s.cv) == 0);
+    wait_idle(s, eid);
+    dprintf("ec flush(%llu), dirty ask server, %u steps...\n", eid, ops.size());
   }
   else {
     dprintf("ec flush(%llu), REMOVE WRITE_BACK not dirty, no RPC call...\n", eid);
@@ -228,12 +1656,12 @@ extent_client::flush(extent_protocol::extentid_t eid)
   }
 
   if (extent_cache[eid].removed) {
-    ret = cl->call(extent_protocol::remove, eid, tmp);
+    ret = cl(eid)->call(extent_protocol::remove, eid, tmp);
     dprintf("ec flush(%llu), removed ask server remove RPC...\n", eid);
   }
   else if (extent_cache[eid].dirty) {
     buf = extent_cache[eid].buf;
-    ret = cl->call(extent_protocol::put, eid, buf, tmp);
+    ret = cl(eid)->call(extent_protocol::put, eid, buf, tmp);
     dprintf("ec flush(%llu), dirty ask server put RPC...\n", eid);
   }
   else {
@@ -243,8 +1671,404 @@ extent_client::flush(extent_protocol::extentid_t eid)
   // disable eid's local cache
 #endif
 
-  extent_cache.erase(eid);
-  pthread_mutex_unlock(&mx);
+  // what was written back is a version of the server's we do not know
+  it = s.entries.find(eid);
+  if (it != s.entries.end() && !ops.empty())
+    forget(s, it);
+  else if (it != s.entries.end())
+    drop(s, it);
+  pthread_mutex_unlock(&s.mx);
   dprintf("ec: flush eid(%llu)\n", eid);
   return ret;
 }
+
+// Write back those of eids that are dirty, one compound RPC per shard,
+// and leave them cached as clean; written tells which were. They are in
+// their stripe's writing until the RPCs are answered, for wait_idle.
+// No stripe is locked over the RPCs, which may call invalidate_handler
+// back.
+extent_protocol::status
+extent_client::writeback(const std::vector<extent_protocol::extentid_t> &eids,
+                         std::vector<bool> &written)
+{
+  extent_protocol::status ret = extent_protocol::OK;
+  // dirty extents are grouped by shard, one compound RPC per shard
+  std::vector<std::vector<extent_protocol::op> > ops(cls.size());
+  std::map<extent_protocol::extentid_t, cache_content>::iterator it;
+
+  written.assign(eids.size(), false);
+  for (uint32_t i = 0; i < eids.size(); ++i) {
+    stripe &s = stripe_of(eids[i]);
+    pthread_mutex_lock(&s.mx);
+    // one write-back of an extent at a time, so they arrive in order
+    while (s.writing.count(eids[i]))
+      VERIFY(pthread_cond_wait(&s.cv, &s.mx) == 0);
+    it = s.entries.find(eids[i]);
+    if (it != s.entries.end() && it->second.dirty) {
+      writeback_ops(eids[i], it->second, ops[shard_of(eids[i])]);
+      s.writing.insert(eids[i]);
+      written[i] = true;
+    }
+    pthread_mutex_unlock(&s.mx);
+  }
+
+  // the shards are written to in parallel, one round trip in all
+  std::vector<compound_call> calls(cls.size());
+  std::vector<pthread_t> th(cls.size());
+  int last = -1;
+  for (uint32_t k = 0; k < cls.size(); ++k) {
+    calls[k].cl = cls[k];
+    calls[k].ops = &ops[k];
+    if (ops[k].empty())
+      continue;
+    if (last >= 0)
+      VERIFY(pthread_create(&th[last], NULL, compound_thread,
+                            (void *)&calls[last]) == 0);
+    last = k;
+  }
+  if (last >= 0)
+    calls[last].ret = cls[last]->call(extent_protocol::compound, ops[last],
+                                      calls[last].res);
+  for (uint32_t k = 0; k < cls.size(); ++k) {
+    if (ops[k].empty())
+      continue;
+    if ((int)k != last)
+      VERIFY(pthread_join(th[k], NULL) == 0);
+    extent_protocol::status r = calls[k].ret;
+    for (uint32_t i = 0; r == extent_protocol::OK && i < calls[k].res.size(); ++i)
+      if (calls[k].res[i].ret != extent_protocol::OK)
+        r = calls[k].res[i].ret;
+    if (r != extent_protocol::OK)
+      ret = r;
+    dprintf("ec writeback: %u write-back steps on shard %u, one compound RPC\n",
+            ops[k].size(), k);
+  }
+
+  for (uint32_t i = 0; i < eids.size(); ++i) {
+    if (!written[i])
+      continue;
+    stripe &s = stripe_of(eids[i]);
+    pthread_mutex_lock(&s.mx);
+    s.writing.erase(eids[i]);
+    VERIFY(pthread_cond_broadcast(&s.cv) == 0);
+    pthread_mutex_unlock(&s.mx);
+  }
+  return ret;
+}
+
+extent_protocol::status
+extent_client::flush(const std::vector<extent_protocol::extentid_t> &eids)
+{
+  extent_protocol::status ret;
+  std::map<extent_protocol::extentid_t, cache_content>::iterator it;
+  std::vector<bool> written;
+
+  ret = writeback(eids, written);
+
+  for (uint32_t i = 0; i < eids.size(); ++i) {
+    stripe &s = stripe_of(eids[i]);
+    pthread_mutex_lock(&s.mx);
+    wait_idle(s, eids[i]);
+    it = s.entries.find(eids[i]);
+    if (it != s.entries.end() && written[i])
+      forget(s, it);
+    else if (it != s.entries.end())
+      drop(s, it);
+    pthread_mutex_unlock(&s.mx);
+  }
+  return ret;
+}
+
+bool
+extent_client::has_lease(extent_protocol::extentid_t eid)
+{
+  bool ret;
+
+  if (!use_leases)
+    return false;
+  pthread_mutex_lock(&lmx);
+  ret = leases.count(eid) && leases[eid].expire > time(NULL);
+  pthread_mutex_unlock(&lmx);
+  return ret;
+}
+
+// Called with eid's lock held. The lease is counted from before the
+// request, so it runs out here no later than on the server.
+extent_protocol::status
+extent_client::lease(extent_protocol::extentid_t eid)
+{
+  extent_protocol::status ret;
+  extent_protocol::result r;
+  unsigned int gen, version;
+  time_t t0;
+
+  if (!use_leases)
+    return extent_protocol::OK;
+  pthread_mutex_lock(&lmx);
+  gen = leases[eid].gen;
+  pthread_mutex_unlock(&lmx);
+  t0 = time(NULL);
+
+  stripe &s = stripe_of(eid);
+  pthread_mutex_lock(&s.mx);
+  cache_content &c = entry(s, eid);
+  do {
+    version = 0;
+    if (!c.dirty && c.kept && c.pages.size() == npages(c.attr.size))
+      version = c.version;
+    else if (!c.dirty && complete(c))
+      version = c.attr.version;
+    unsigned int cgen = begin_fetch(s, eid, c);
+    ret = cl(eid)->call(extent_protocol::get_lease, id, eid, version, r);
+    if (end_fetch(s, c, cgen))
+      break;
+  } while (true);
+  if (ret != extent_protocol::OK && ret != extent_protocol::NOTMODIFIED) {
+    pthread_mutex_unlock(&s.mx);
+    return ret;
+  }
+
+  if (!c.dirty) {
+    if (ret == extent_protocol::OK)
+      set_contents(c, r.data);
+    else if (c.kept && c.version != version)
+      c.pages.clear();
+    c.kept = false;
+    c.attr = r.a;
+    c.valid_attr = true;
+    c.attr_expire = 0;
+  }
+  account(c);
+  pthread_mutex_unlock(&s.mx);
+  evict();
+
+  pthread_mutex_lock(&lmx);
+  if (leases[eid].gen == gen)
+    leases[eid].expire = t0 + LEASE_TIME;
+  pthread_mutex_unlock(&lmx);
+  dprintf("ec lease(%llu) version(%u)%s\n", eid, r.a.version,
+          ret == extent_protocol::NOTMODIFIED ? ", kept copy still current" : "");
+  return extent_protocol::OK;
+}
+
+// Before eid's cached copy first becomes dirty, the write lease breaks
+// the other clients' read leases, as the change will not reach the
+// server until the copy is written back.
+void
+extent_client::write_lease(extent_protocol::extentid_t eid)
+{
+  std::map<extent_protocol::extentid_t, cache_content>::iterator it;
+  bool need;
+  int r;
+
+  if (!use_leases)
+    return;
+  stripe &s = stripe_of(eid);
+  pthread_mutex_lock(&s.mx);
+  it = s.entries.find(eid);
+  need = it == s.entries.end() || !it->second.dirty;
+  pthread_mutex_unlock(&s.mx);
+  if (need)
+    cl(eid)->call(extent_protocol::write_lease, id, eid, r);
+}
+
+
+// Stop trusting a clean cached copy of eid; it stays behind, kept, for
+// get_if_changed, load or lease to check against the server's version.
+// A dirty copy is ours, written under the lock, and is left alone. A
+// fetch into the copy that is under way is not waited for; gen makes
+// it start again.
+void
+extent_client::suspect(extent_protocol::extentid_t eid)
+{
+  std::map<extent_protocol::extentid_t, cache_content>::iterator it;
+  stripe &s = stripe_of(eid);
+
+  pthread_mutex_lock(&s.mx);
+  it = s.entries.find(eid);
+  if (it != s.entries.end() && !it->second.dirty) {
+    cache_content &c = it->second;
+    c.gen++;
+    c.names.clear();
+    if (!c.kept && !c.pages.empty() && size_known(c)) {
+      c.version = c.attr.version;
+      c.kept = true;
+    } else if (!c.kept) {
+      c.pages.clear();
+      account(c, false);
+    }
+    c.valid_attr = false;
+  }
+  pthread_mutex_unlock(&s.mx);
+}
+
+// A lock that comes from the lock server, rather than from our own cache
+// of it, may find a copy that was read under a lease since run out.
+void
+extent_client::acquired(extent_protocol::extentid_t eid)
+{
+  if (use_leases)
+    suspect(eid);
+}
+
+// The server is about to change eid: give up the lease and the copy.
+rextent_protocol::status
+extent_client::invalidate_handler(extent_protocol::extentid_t eid, int &)
+{
+  pthread_mutex_lock(&lmx);
+  leases[eid].gen++;
+  leases[eid].expire = 0;
+  pthread_mutex_unlock(&lmx);
+
+  suspect(eid);
+  dprintf("ec invalidate(%llu)\n", eid);
+  return rextent_protocol::OK;
+}
+
+// Write every whole, clean copy to cache_dir for the next run, with the
+// version of the server's contents it is a copy of, and the boot ids
+// of the servers those versions belong to. A file is written under a
+// name of this client's first, so a crash, or another client saving to
+// the same directory, leaves one whole file or none.
+void
+extent_client::save()
+{
+  std::map<extent_protocol::extentid_t, cache_content>::iterator it;
+  std::string data;
+  uint32_t n = 0;
+
+  if (boots.empty())
+    return;
+  std::ostringstream bpath;
+  bpath << cache_dir << "/boot.tmp." << getpid() << "." << (void *)this;
+  std::string btmp = bpath.str();
+  FILE *bf = fopen(btmp.c_str(), "w");
+  if (bf == NULL)
+    return;
+  bool bok = true;
+  for (uint32_t k = 0; k < boots.size(); ++k)
+    bok = fprintf(bf, "%llu\n", boots[k]) > 0 && bok;
+  bok = fclose(bf) == 0 && bok;
+  if (!bok || rename(btmp.c_str(), (cache_dir + "/boot").c_str()) != 0) {
+    unlink(btmp.c_str());
+    return;
+  }
+
+  for (uint32_t k = 0; k < CACHE_STRIPES; ++k) {
+    stripe &s = stripes[k];
+    pthread_mutex_lock(&s.mx);
+    for (it = s.entries.begin(); it != s.entries.end(); ++it) {
+      cache_content &c = it->second;
+      if (c.dirty || c.busy ||
+          !((c.kept && c.pages.size() == npages(c.attr.size)) || complete(c)))
+        continue;
+      extent_protocol::attr a = c.attr;
+      a.version = c.kept ? c.version : c.attr.version;
+      if (a.version == 0)
+        continue;
+      contents(c, 0, a.size, data);
+
+      std::ostringstream path;
+      path << cache_dir << "/" << it->first;
+      std::ostringstream tmps;
+      tmps << path.str() << ".tmp." << getpid() << "." << (void *)this;
+      std::string tmp = tmps.str();
+      FILE *f = fopen(tmp.c_str(), "w");
+      if (f == NULL)
+        continue;
+      bool ok = fprintf(f, "yfs-cache %u %u %u %u %u %u\n", a.type, a.atime,
+                        a.mtime, a.ctime, a.size, a.version) > 0 &&
+                fwrite(data.data(), 1, data.size(), f) == data.size();
+      ok = fclose(f) == 0 && ok;
+      if (ok && rename(tmp.c_str(), path.str().c_str()) == 0)
+        n++;
+      else
+        unlink(tmp.c_str());
+    }
+    pthread_mutex_unlock(&s.mx);
+  }
+  dprintf("ec save: %u extents to %s\n", n, cache_dir.c_str());
+}
+
+// Take back the copies save() left in cache_dir, as kept copies: each is
+// checked against the server's version before it is used, so one that
+// has not changed costs a get_if_changed that sends no data back, and
+// one that has is fetched again. A version only means something within
+// one run of a server, so if any shard has restarted since the copies
+// were saved, they are all thrown away. The files are removed as they
+// are read; those past the memory budget are removed unread.
+void
+extent_client::restore()
+{
+  DIR *dir;
+  struct dirent *de;
+  std::vector<unsigned long long> saved;
+  unsigned long long b;
+  uint32_t n = 0;
+
+  for (uint32_t k = 0; k < cls.size(); ++k) {
+    if (cls[k]->call(extent_protocol::boot_id, 0, b) != extent_protocol::OK) {
+      boots.clear();
+      break;
+    }
+    boots.push_back(b);
+  }
+
+  std::string bpath = cache_dir + "/boot";
+  FILE *bf = fopen(bpath.c_str(), "r");
+  if (bf != NULL) {
+    while (fscanf(bf, "%llu", &b) == 1)
+      saved.push_back(b);
+    fclose(bf);
+    unlink(bpath.c_str());
+  }
+  bool stale = boots.empty() || saved != boots;
+
+  if ((dir = opendir(cache_dir.c_str())) == NULL)
+    return;
+  while ((de = readdir(dir)) != NULL) {
+    std::string path = cache_dir + "/" + de->d_name;
+    if (strncmp(de->d_name, "boot.tmp.", 9) == 0) {
+      unlink(path.c_str());
+      continue;
+    }
+    char *end;
+    extent_protocol::extentid_t eid = strtoull(de->d_name, &end, 10);
+    if (eid == 0 || (*end != '\0' && strncmp(end, ".tmp.", 5) != 0))
+      continue;
+    FILE *f = NULL;
+    if (stale || *end != '\0' || over_budget() ||
+        (f = fopen(path.c_str(), "r")) == NULL) {
+      unlink(path.c_str());
+      continue;
+    }
+    extent_protocol::attr a;
+    std::string data;
+    // a "\n" in the format would also eat whitespace the data starts with
+    bool ok = fscanf(f, "yfs-cache %u %u %u %u %u %u", &a.type, &a.atime,
+                     &a.mtime, &a.ctime, &a.size, &a.version) == 6 &&
+              fgetc(f) == '\n' && a.size <= MAXFILE * BLOCK_SIZE;
+    if (ok) {
+      data.resize(a.size);
+      ok = a.size == 0 || fread(&data[0], 1, a.size, f) == a.size;
+    }
+    fclose(f);
+    unlink(path.c_str());
+    if (!ok)
+      continue;
+
+    stripe &s = stripe_of(eid);
+    pthread_mutex_lock(&s.mx);
+    cache_content &c = s.entries[eid];
+    c.attr = a;
+    c.version = a.version;
+    c.kept = true;
+    set_contents(c, data);
+    account(c, false);
+    pthread_mutex_unlock(&s.mx);
+    n++;
+  }
+  closedir(dir);
+  dprintf("ec restore: %u extents from %s%s\n", n, cache_dir.c_str(),
+          stale ? ", stale" : "");
+}
@@ -6,41 +6,352 @@
 #include <string>
 #include "extent_protocol.h"
 #include "extent_server.h"
+#include "handle.h"
 
 #include "tprintf.h"
+#include <list>
 #include <map>
+#include <set>
+#include <vector>
 #include <pthread.h>
+#include <time.h>
+
+// Size of the pages extent_client caches extents in; a multiple of
+// DIRENT_SIZE, so no directory slot spans two pages.
+#define CACHE_PAGE_SIZE 4096
+
+// Number of independently locked parts extent_client's cache is split
+// into, by inum.
+#define CACHE_STRIPES 16
+
+// The replicas of one extent_server shard, "host:port|host:port|...",
+// the initial primary first. With one replica this is a plain rpcc.
+// Otherwise reads go to the replicas in turn and mutations to the
+// primary; a call that fails or is refused with NOTPRIMARY is retried,
+// moving on to the next replica, until one of them has taken over.
+class extent_shard {
+ private:
+  std::vector<std::string> addrs;
+  rpcc *single;
+  uint32_t primary;
+  uint32_t next_read;
+  pthread_mutex_t smx;
+
+  // ms; above REPL_LEASE, as a primary may wait that long to answer
+  static const int rpc_timeout = 5000;
+
+  bool is_read(unsigned int proc);
+  uint32_t pick(bool read);
+  bool retry(uint32_t idx, int ret, int tries);
+
+  template<class R, class A1>
+  int call1(bool read, unsigned int proc, const A1 &a1, R &r)
+  {
+    int ret;
+    for (int tries = 0; ; tries++) {
+      uint32_t idx = pick(read && tries == 0);
+      handle h(addrs[idx]);
+      rpcc *cl = h.safebind();
+      r = R();
+      ret = cl ? cl->call(proc, a1, r, rpcc::to(rpc_timeout))
+               : rpc_const::bind_failure;
+      if (!retry(idx, ret, tries))
+        return ret;
+    }
+  }
+
+ public:
+  extent_shard(std::string dst);
+
+  template<class R, class A1>
+  int call(unsigned int proc, const A1 &a1, R &r)
+  {
+    if (single)
+      return single->call(proc, a1, r);
+    return call1(is_read(proc), proc, a1, r);
+  }
+
+  // a compound request is a read if all of its steps are
+  int call(unsigned int proc, const std::vector<extent_protocol::op> &ops,
+           std::vector<extent_protocol::result> &r)
+  {
+    if (single)
+      return single->call(proc, ops, r);
+    bool read = true;
+    for (uint32_t i = 0; i < ops.size(); ++i)
+      read = read && is_read(ops[i].type);
+    return call1(read, proc, ops, r);
+  }
+
+  template<class R, class A1, class A2>
+  int call(unsigned int proc, const A1 &a1, const A2 &a2, R &r)
+  {
+    if (single)
+      return single->call(proc, a1, a2, r);
+    int ret;
+    for (int tries = 0; ; tries++) {
+      uint32_t idx = pick(is_read(proc) && tries == 0);
+      handle h(addrs[idx]);
+      rpcc *cl = h.safebind();
+      r = R();
+      ret = cl ? cl->call(proc, a1, a2, r, rpcc::to(rpc_timeout))
+               : rpc_const::bind_failure;
+      if (!retry(idx, ret, tries))
+        return ret;
+    }
+  }
+
+  template<class R, class A1, class A2, class A3>
+  int call(unsigned int proc, const A1 &a1, const A2 &a2, const A3 &a3, R &r)
+  {
+    if (single)
+      return single->call(proc, a1, a2, a3, r);
+    int ret;
+    for (int tries = 0; ; tries++) {
+      uint32_t idx = pick(is_read(proc) && tries == 0);
+      handle h(addrs[idx]);
+      rpcc *cl = h.safebind();
+      r = R();
+      ret = cl ? cl->call(proc, a1, a2, a3, r, rpcc::to(rpc_timeout))
+               : rpc_const::bind_failure;
+      if (!retry(idx, ret, tries))
+        return ret;
+    }
+  }
+};
 
 class extent_client {
  public:
+  // An extent is cached as fixed-size pages, each valid on its own and
+  // dirty on its own. Page i holds the bytes from i*CACHE_PAGE_SIZE on,
+  // cut at attr.size; a page that is not in pages is not cached. Pages
+  // past the end of the extent do not exist. A dirty page knows the
+  // spans of it written since the last write-back, start to end, and
+  // only those go back.
+  struct page {
+    std::string data;
+    bool dirty;
+    std::map<uint32_t, uint32_t> spans;
+    page() : dirty(false) {}
+    void touch(uint32_t from, uint32_t to);
+  };
   class cache_content {
    public:
-    std::string buf;
+    std::map<uint32_t, page> pages;
     extent_protocol::attr attr;
+    // something is to be written back: the dirty pages, after a truncate
+    // to attr.size if resized is set, or all of it in one put if whole is
     bool dirty;
-    bool valid_buf;
+    bool whole;
+    bool resized;
     bool valid_attr;
     bool removed;
-    cache_content() {dirty=false;valid_buf=false;valid_attr=false;removed=false;}
+    // nonzero if attr was prefetched by readdir_plus without holding the
+    // extent's lock; it is then only trusted until this time
+    time_t attr_expire;
+    // the server's version of the extent that the pages were read at; a
+    // clean copy is kept (kept is set) when the lock goes, and is only
+    // used again once the server's version is seen not to have moved on
+    unsigned int version;
+    bool kept;
+    // bytes in pages, and in dirty pages, as last counted by account();
+    // referenced is set on use and cleared by evict()'s clock hand
+    uint32_t nbytes;
+    uint32_t ndirty;
+    bool referenced;
+    // when it last became dirty, for flusher(); 0 while clean
+    time_t dirtied;
+    // a thread is fetching into it with the stripe unlocked; gen counts
+    // suspect() calls, so such a fetch can tell it is out of date
+    bool busy;
+    unsigned int gen;
+    // read-ahead: where a sequential read would start, the window in
+    // pages (0 while reads are not sequential), the first page not yet
+    // asked for ahead, and the pages being read ahead now
+    uint32_t ra_next;
+    uint32_t ra_window;
+    uint32_t ra_end;
+    std::set<uint32_t> ahead;
+    // a directory's dir_lookup answers, name to inum (0 if absent) and
+    // until when, held as long as its lock or lease; pinned counts the
+    // lookups under way, which keep the entry from being dropped
+    std::map<std::string, std::pair<extent_protocol::extentid_t, time_t> > names;
+    uint32_t pinned;
+    cache_content() {dirty=false;whole=false;resized=false;valid_attr=false;removed=false;attr_expire=0;version=0;kept=false;nbytes=0;ndirty=0;referenced=false;dirtied=0;busy=false;gen=0;ra_next=0;ra_window=0;ra_end=0;pinned=0;}
   };
  private:
-  rpcc *cl;
-  std::map<extent_protocol::extentid_t, cache_content> extent_cache;
+  // one entry per extent_server shard; see extent_server::local()
+  std::vector<extent_shard *> cls;
+  uint32_t next_shard;
+  uint32_t shard_of(extent_protocol::extentid_t eid);
+  extent_shard *cl(extent_protocol::extentid_t eid) { return cls[shard_of(eid)]; }
+
+  // The cache entries, striped by inum, each stripe under its own lock.
+  // No lock is held over an RPC: an entry being fetched into is busy
+  // meanwhile, and others wanting it wait on cv and then find what was
+  // fetched. writing holds the stripe's extents being written back by
+  // writeback(), flush() or dir_writeback(), from the moment their
+  // dirty bit is cleared until the server has answered. A stripe's
+  // lock is taken before mx, never after.
+  struct stripe {
+    std::map<extent_protocol::extentid_t, cache_content> entries;
+    std::set<extent_protocol::extentid_t> writing;
+    extent_protocol::extentid_t clock_hand;
+    pthread_mutex_t mx;
+    pthread_cond_t cv;
+  };
+  stripe stripes[CACHE_STRIPES];
+  stripe &stripe_of(extent_protocol::extentid_t eid) { return stripes[eid % CACHE_STRIPES]; }
+  cache_content &entry(stripe &s, extent_protocol::extentid_t eid);
+  void wait_idle(stripe &s, extent_protocol::extentid_t eid);
+  unsigned int begin_fetch(stripe &s, extent_protocol::extentid_t eid,
+                           cache_content &c);
+  bool end_fetch(stripe &s, cache_content &c, unsigned int gen);
+  // guards next_shard, the byte counts below, and the flusher's and
+  // the read-ahead thread's state
   pthread_mutex_t mx;
 
+  // Memory budget (YFS_CACHE_BYTES; 0 is unbounded) for the bytes in
+  // cached pages, kept by evict(), and the bytes cached and dirty now.
+  uint64_t cache_budget;
+  uint64_t resident_bytes;
+  uint64_t dirty_bytes;
+  uint32_t next_stripe;
+  extent_protocol::status writeback(const std::vector<extent_protocol::extentid_t> &eids,
+                                    std::vector<bool> &written);
+  void account(cache_content &c, bool used = true);
+  void forget(stripe &s, std::map<extent_protocol::extentid_t, cache_content>::iterator it);
+  bool over_budget();
+  void sweep(stripe &s, std::vector<extent_protocol::extentid_t> &dirty);
+  void evict();
+
+  // Background write-back, on when YFS_FLUSH_AGE=<seconds> or
+  // YFS_FLUSH_BYTES=<bytes> is set: flusher() writes back the extents
+  // dirty for flush_age seconds, and the oldest ones while dirty_bytes
+  // is over flush_bytes, and leaves them cached as clean.
+  int flush_age;
+  uint64_t flush_bytes;
+  bool flusher_on;
+  bool stopping;
+  pthread_t flusher_th;
+  pthread_cond_t fcv;
+
+  // Read-ahead, up to ra_max pages at a time (YFS_READAHEAD): windows
+  // queued by read_ahead() are read by prefetcher() in the background.
+  struct ra_req {
+    extent_protocol::extentid_t eid;
+    uint32_t first;
+    uint32_t n;
+  };
+  uint32_t ra_max;
+  std::list<ra_req> ra_queue;
+  pthread_t ra_th;
+  pthread_cond_t racv;
+  void read_ahead(extent_protocol::extentid_t eid, cache_content &c,
+                  uint32_t off, uint32_t end);
+  void prefetch(extent_protocol::extentid_t eid, uint32_t first, uint32_t n);
+  void unname(extent_protocol::extentid_t parent);
+
+  // seconds readdir_plus attributes and dir_lookup answers are trusted
+  int attr_ttl;
+  int lookup_ttl;
+
+  // Local directory (YFS_CACHE_DIR) the clean copies are saved to when
+  // the client goes away, and restored from when the next one starts.
+  // boots are the shards' boot ids as of this client's start, which the
+  // copies are saved under; empty if they could not be had.
+  std::string cache_dir;
+  std::vector<unsigned long long> boots;
+  void save();
+  void restore();
+
+  // Read leases (YFS_LEASES=1). While one is held the extent's cached
+  // copy is read without taking its lock; the server calls invalidate
+  // before the extent changes. gen counts the callbacks, so a lease
+  // granted before one of them is not taken for a new one.
+  struct lease_info {
+    time_t expire;
+    unsigned int gen;
+    lease_info() : expire(0), gen(0) {}
+  };
+  bool use_leases;
+  std::string id;
+  std::map<extent_protocol::extentid_t, lease_info> leases;
+  pthread_mutex_t lmx;
+
+  bool size_known(const cache_content &c);
+  bool complete(const cache_content &c);
+  extent_protocol::status load(stripe &s, extent_protocol::extentid_t eid,
+                               const std::vector<uint32_t> &want);
+  void set_contents(cache_content &c, const std::string &buf);
+  void contents(const cache_content &c, uint32_t off, uint32_t len,
+                std::string &buf);
+  void resize(cache_content &c, uint32_t size);
+  extent_protocol::status write(stripe &s, extent_protocol::extentid_t eid,
+                                uint32_t off, const char *buf, uint32_t len);
+  void writeback_ops(extent_protocol::extentid_t eid, cache_content &c,
+                     std::vector<extent_protocol::op> &ops);
+  void dir_writeback(extent_protocol::extentid_t parent, bool drop);
+  void created(const extent_protocol::result &r);
+  void drop(stripe &s, std::map<extent_protocol::extentid_t, cache_content>::iterator it);
+  bool attr_valid(const cache_content &c);
+  void suspect(extent_protocol::extentid_t eid);
+  void write_lease(extent_protocol::extentid_t eid);
+
  public:
+  static int last_port;
+  // dst is "host:port" or a comma-separated list of shards, in shard
+  // order, each of which may list its replicas; see extent_shard
   extent_client(std::string dst);
   ~extent_client();
+  // stop flushing and reading ahead in the background, and save the
+  // clean copies if YFS_CACHE_DIR is set; the client still works
+  // without them, so lock releases may flush through it afterwards
+  void shutdown();
 
   extent_protocol::status create(uint32_t type, extent_protocol::extentid_t &eid);
+  extent_protocol::status create(uint32_t type, extent_protocol::extentid_t parent,
+                                 std::string name, extent_protocol::extentid_t &eid);
   extent_protocol::status get(extent_protocol::extentid_t eid, 
 			                        std::string &buf);
   extent_protocol::status getattr(extent_protocol::extentid_t eid, 
 				                          extent_protocol::attr &a);
-  extent_protocol::status put(extent_protocol::extentid_t eid, std::string buf);
+  extent_protocol::status put(extent_protocol::extentid_t eid, const std::string &buf);
   extent_protocol::status remove(extent_protocol::extentid_t eid);
+  extent_protocol::status get_range(extent_protocol::extentid_t eid, uint32_t off,
+                                    uint32_t len, std::string &buf);
+  extent_protocol::status put_range(extent_protocol::extentid_t eid, uint32_t off,
+                                    const std::string &buf);
+  extent_protocol::status put_range(extent_protocol::extentid_t eid, uint32_t off,
+                                    const char *buf, uint32_t len);
+  extent_protocol::status truncate(extent_protocol::extentid_t eid, uint32_t size);
+  extent_protocol::status append(extent_protocol::extentid_t eid, const std::string &buf,
+                                 uint32_t &off);
+  extent_protocol::status dir_lookup(extent_protocol::extentid_t parent,
+                                     std::string name,
+                                     extent_protocol::extentid_t &ino);
+  extent_protocol::status dir_add(extent_protocol::extentid_t parent,
+                                  std::string name,
+                                  extent_protocol::extentid_t ino);
+  extent_protocol::status dir_remove(extent_protocol::extentid_t parent,
+                                     std::string name,
+                                     extent_protocol::extentid_t &ino);
+  extent_protocol::status readdir_plus(extent_protocol::extentid_t dir,
+                                       std::vector<extent_protocol::dirent_plus> &ents);
+  // bytes held in cached pages, and how many of them are dirty
+  void usage(uint64_t &resident, uint64_t &dirty);
+  bool has_lease(extent_protocol::extentid_t eid);
+  // take or renew a read lease on eid, bringing its cached copy up to date
+  extent_protocol::status lease(extent_protocol::extentid_t eid);
+  // eid's lock was just granted by the lock server
+  void acquired(extent_protocol::extentid_t eid);
+  rextent_protocol::status invalidate_handler(extent_protocol::extentid_t eid, int &);
   // for lab5
   extent_protocol::status flush(extent_protocol::extentid_t eid);
+  // write back and drop several extents in one round trip
+  extent_protocol::status flush(const std::vector<extent_protocol::extentid_t> &eids);
+  void flusher();
+  void prefetcher();
   //extent_protocol::status _flush(extent_protocol::extentid_t eid);
   //extent_protocol::status flush(unsigned long long eid);
 };
@@ -9,13 +9,29 @@ class extent_protocol {
  public:
   typedef int status;
   typedef unsigned long long extentid_t;
-  enum xxstatus { OK, RPCERR, NOENT, IOERR };
+  enum xxstatus { OK, RPCERR, NOENT, IOERR, EXIST, NOTPRIMARY, NOTMODIFIED };
   enum rpc_numbers {
     put = 0x6001,
     get,
     getattr,
     remove,
-    create
+    create,
+    get_range,
+    put_range,
+    truncate,
+    compound,
+    dir_lookup,
+    dir_add,
+    dir_remove,
+    readdir_plus,
+    replicate,
+    heartbeat,
+    create_v2,
+    get_if_changed,
+    append,
+    get_lease,
+    write_lease,
+    boot_id
   };
 
   enum types {
@@ -29,9 +45,92 @@ class extent_protocol {
     unsigned int mtime;
     unsigned int ctime;
     unsigned int size;
+    unsigned int version;   // changes whenever the content does
+  };
+
+  // One step of a compound request; type is the rpc number of the
+  // operation, and off/len/data are used as that operation needs them
+  // (create: off is the type; truncate: off is the size; dir_add and
+  // dir_remove: data is the name and dir_add's off the inum; create_v2:
+  // eid is the parent or 0, off the type and data the name). The same
+  // form carries mutations from a primary to its backups, with the inum
+  // the primary allocated in create's eid or create_v2's len.
+  struct op {
+    uint32_t type;
+    extentid_t eid;
+    uint32_t off;
+    uint32_t len;
+    std::string data;
+  };
+
+  // one directory entry with the attributes of the inode it names
+  struct dirent_plus {
+    std::string name;
+    extentid_t inum;
+    attr a;
+  };
+
+  struct result {
+    status ret;
+    extentid_t eid;     // create, create_v2: the new extent
+    attr a;             // getattr, create_v2, get_if_changed, append
+    std::string data;   // get, get_range, get_if_changed
   };
 };
 
+// Primary/backup replication of an extent_server (all in seconds): the
+// primary contacts every backup at least each REPL_HEARTBEAT; a backup
+// answers reads until REPL_LEASE after it last heard from the primary,
+// and the backup ranked k places after the primary takes over once it
+// has heard nothing for k * REPL_FAILOVER.
+#define REPL_HEARTBEAT 1
+#define REPL_LEASE 3
+#define REPL_FAILOVER 5
+
+// Read leases, in seconds: for LEASE_TIME after get_lease the server
+// calls the client back with rextent_protocol::invalidate before the
+// extent changes, or before another client takes the write lease with
+// write_lease. Clients count the time from before their request.
+#define LEASE_TIME 5
+
+class rextent_protocol {
+ public:
+  enum xxstatus { OK, RPCERR };
+  typedef int status;
+  enum rpc_numbers {
+    invalidate = 0x6101
+  };
+};
+
+// A directory is an array of fixed-size slots, so an entry can be found,
+// added or removed without rewriting the others. Each slot holds a
+// 4-byte inum (0 marks a free slot), a 1-byte name length and the name.
+#define DIRENT_SIZE 128
+#define DIRENT_NAMEMAX (DIRENT_SIZE - 5)
+
+inline void
+dirent_pack(char *slot, uint32_t inum, const std::string &name)
+{
+  memset(slot, 0, DIRENT_SIZE);
+  memcpy(slot, &inum, 4);
+  slot[4] = (char)name.size();
+  memcpy(slot + 5, name.data(), name.size());
+}
+
+inline uint32_t
+dirent_unpack(const char *slot, std::string &name)
+{
+  uint32_t inum;
+  unsigned char len;
+
+  memcpy(&inum, slot, 4);
+  len = (unsigned char)slot[4];
+  if (len > DIRENT_NAMEMAX)
+    len = DIRENT_NAMEMAX;
+  name.assign(slot + 5, len);
+  return inum;
+}
+
 inline unmarshall &
 operator>>(unmarshall &u, extent_protocol::attr &a)
 {
@@ -40,6 +139,7 @@ operator>>(unmarshall &u, extent_protocol::attr &a)
   u >> a.mtime;
   u >> a.ctime;
   u >> a.size;
+  u >> a.version;
   return u;
 }
 
@@ -51,7 +151,68 @@ operator<<(marshall &m, extent_protocol::attr a)
   m << a.mtime;
   m << a.ctime;
   m << a.size;
+  m << a.version;
+  return m;
+}
+
+inline unmarshall &
+operator>>(unmarshall &u, extent_protocol::op &o)
+{
+  u >> o.type;
+  u >> o.eid;
+  u >> o.off;
+  u >> o.len;
+  u >> o.data;
+  return u;
+}
+
+inline marshall &
+operator<<(marshall &m, const extent_protocol::op &o)
+{
+  m << o.type;
+  m << o.eid;
+  m << o.off;
+  m << o.len;
+  m << o.data;
+  return m;
+}
+
+inline unmarshall &
+operator>>(unmarshall &u, extent_protocol::result &r)
+{
+  u >> r.ret;
+  u >> r.eid;
+  u >> r.a;
+  u >> r.data;
+  return u;
+}
+
+inline marshall &
+operator<<(marshall &m, const extent_protocol::result &r)
+{
+  m << r.ret;
+  m << r.eid;
+  m << r.a;
+  m << r.data;
+  return m;
+}
+
+inline unmarshall &
+operator>>(unmarshall &u, extent_protocol::dirent_plus &e)
+{
+  u >> e.name;
+  u >> e.inum;
+  u >> e.a;
+  return u;
+}
+
+inline marshall &
+operator<<(marshall &m, const extent_protocol::dirent_plus &e)
+{
+  m << e.name;
+  m << e.inum;
+  m << e.a;
   return m;
 }
 
-#endif 
+#endif
@@ -1,6 +1,7 @@
 // the extent server implementation
 
 #include "extent_server.h"
+#include "handle.h"
 #include <sstream>
 #include <stdio.h>
 #include <stdlib.h>
@@ -8,74 +9,1317 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <sys/time.h>
 
-extent_server::extent_server() 
+// every writer in a batch holds one of rpcs' handler threads, so no
+// batch can be larger
+#define BATCH_MAX rpcs::dispatch_threads
+
+// A range that ends past the largest file, or past 4 GB, is refused
+// before it reaches the inode layer or the backups.
+static bool
+range_ok(uint32_t off, uint32_t len)
 {
-  im = new inode_manager();
+  return (uint64_t)off + len <= MAXFILE * BLOCK_SIZE;
 }
 
-int extent_server::create(uint32_t type, extent_protocol::extentid_t &id)
+void *
+defrag_thread(void *es)
+{
+  extent_server *srv = (extent_server *)es;
+  char *interval_env = getenv("YFS_DEFRAG_INTERVAL");
+  srv->defrag(atoi(interval_env));
+  pthread_exit(NULL);
+}
+
+void *
+committer_thread(void *es)
+{
+  extent_server *srv = (extent_server *)es;
+  srv->committer();
+  pthread_exit(NULL);
+}
+
+void *
+replica_thread(void *es)
+{
+  extent_server *srv = (extent_server *)es;
+  srv->replica_loop();
+  pthread_exit(NULL);
+}
+
+extent_server::extent_server(uint32_t shard, uint32_t nshards)
+  : shard(shard), nshards(nshards)
+{
+  im = new inode_manager(shard == 0);
+
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  boot = ((unsigned long long)tv.tv_sec * 1000000 + tv.tv_usec) ^
+         ((unsigned long long)getpid() << 48);
+  VERIFY(pthread_mutex_init(&mx, NULL) == 0);
+  VERIFY(pthread_mutex_init(&rmx, NULL) == 0);
+  VERIFY(pthread_mutex_init(&vmx, NULL) == 0);
+  VERIFY(pthread_mutex_init(&lmx, NULL) == 0);
+  me = view = seq = 0;
+  stale = false;
+  last_hb = fence = 0;
+
+  batch_window = 0;
+  VERIFY(pthread_mutex_init(&bmx, NULL) == 0);
+  VERIFY(pthread_cond_init(&batch_cv, NULL) == 0);
+  VERIFY(pthread_cond_init(&done_cv, NULL) == 0);
+  char *window_env = getenv("YFS_BATCH_WINDOW");
+  if (window_env != NULL && atoi(window_env) > 0) {
+    batch_window = atoi(window_env);
+    pthread_t th;
+    VERIFY(pthread_create(&th, NULL, committer_thread, (void *)this) == 0);
+  }
+
+  // YFS_DEFRAG_INTERVAL=<seconds> turns on the online defragmenter
+  char *interval_env = getenv("YFS_DEFRAG_INTERVAL");
+  if (interval_env != NULL && atoi(interval_env) > 0) {
+    pthread_t th;
+    VERIFY(pthread_create(&th, NULL, defrag_thread, (void *)this) == 0);
+  }
+}
+
+uint32_t
+extent_server::local(extent_protocol::extentid_t id)
+{
+  id &= 0x7fffffff;
+  if (id == 0)
+    return 0;
+  return (id - 1) / nshards + 1;
+}
+
+extent_protocol::extentid_t
+extent_server::global(uint32_t inum)
+{
+  if (inum == 0)
+    return 0;
+  return (extent_protocol::extentid_t)(inum - 1) * nshards + shard + 1;
+}
+
+bool
+extent_server::is_local(extent_protocol::extentid_t id)
+{
+  id &= 0x7fffffff;
+  return id != 0 && (id - 1) % nshards == shard;
+}
+
+void
+extent_server::frag_stats(frag_stat &st)
+{
+  std::vector<blockid_t> blocks;
+  uint32_t runs;
+
+  memset(&st, 0, sizeof(st));
+  for (uint32_t inum = 1; inum < INODE_NUM; ++inum) {
+    pthread_mutex_lock(&mx);
+    bool used = im->block_map(inum, blocks);
+    pthread_mutex_unlock(&mx);
+    if (!used || blocks.empty())
+      continue;
+    runs = count_runs(blocks);
+    st.files++;
+    st.blocks += blocks.size();
+    st.runs += runs;
+    if (runs > 1)
+      st.fragmented++;
+  }
+}
+
+// Walk the inode table every interval seconds and move fragmented files
+// into contiguous runs. mx is taken per file, so RPCs keep being served
+// while a pass is running.
+void
+extent_server::defrag(int interval)
+{
+  frag_stat before, after;
+  uint32_t moved;
+
+  while (true) {
+    sleep(interval);
+    frag_stats(before);
+    if (before.fragmented == 0)
+      continue;
+
+    moved = 0;
+    for (uint32_t inum = 1; inum < INODE_NUM; ++inum) {
+      pthread_mutex_lock(&mx);
+      if (im->relocate_file(inum))
+        moved++;
+      pthread_mutex_unlock(&mx);
+    }
+
+    frag_stats(after);
+    printf("es: defrag moved %u files\n", moved);
+    printf("es: defrag before: %u/%u files fragmented, %u blocks in %u runs\n",
+           before.fragmented, before.files, before.blocks, before.runs);
+    printf("es: defrag after:  %u/%u files fragmented, %u blocks in %u runs\n",
+           after.fragmented, after.files, after.blocks, after.runs);
+  }
+}
+
+int extent_server::_create(uint32_t type, extent_protocol::extentid_t &id)
 {
   // alloc a new inode and return inum
   //printf("zzz: es: create inode\n");
-  id = im->alloc_inode(type);
+  pthread_mutex_lock(&mx);
+  id = global(im->alloc_inode(type));
+  pthread_mutex_unlock(&mx);
 
+  if (id == 0)
+    return extent_protocol::IOERR;
   return extent_protocol::OK;
 }
 
-int extent_server::put(extent_protocol::extentid_t id, std::string buf, int &)
+// Allocate an inode and, if parent is nonzero, link it into that
+// directory as name in the same step. r gets the new inum and its
+// attributes; if name is taken, EXIST with the inum it names instead.
+int extent_server::_create_v2(uint32_t type, extent_protocol::extentid_t parent,
+                              std::string name, extent_protocol::result &r)
 {
-  id &= 0x7fffffff;
+  dir_index *d = NULL;
+  uint32_t inum;
+
+  r.eid = 0;
+  memset(&r.a, 0, sizeof(r.a));
+  if (parent != 0 && (!is_local(parent) || name.empty() ||
+                      name.size() > DIRENT_NAMEMAX))
+    return r.ret = extent_protocol::IOERR;
+
+  pthread_mutex_lock(&mx);
+  if (parent != 0) {
+    d = load_dir(local(parent));
+    if (d == NULL) {
+      pthread_mutex_unlock(&mx);
+      return r.ret = extent_protocol::IOERR;
+    }
+    if (d->inums.count(name)) {
+      r.eid = d->inums[name];
+      if (is_local(r.eid))
+        im->getattr(local(r.eid), r.a);
+      pthread_mutex_unlock(&mx);
+      return r.ret = extent_protocol::EXIST;
+    }
+  }
+
+  inum = im->alloc_inode(type);
+  if (inum == 0) {
+    pthread_mutex_unlock(&mx);
+    return r.ret = extent_protocol::IOERR;
+  }
+  r.eid = global(inum);
+  if (d != NULL && dir_link(d, local(parent), name, r.eid) != extent_protocol::OK) {
+    im->free_inode(inum);
+    r.eid = 0;
+    pthread_mutex_unlock(&mx);
+    return r.ret = extent_protocol::IOERR;
+  }
+  im->getattr(inum, r.a);
+  pthread_mutex_unlock(&mx);
+
+  return r.ret = extent_protocol::OK;
+}
+
+int extent_server::_put(extent_protocol::extentid_t id, const std::string &buf, int &)
+{
+  if (batch_window > 0)
+    return batch_write(extent_protocol::put, id, 0, buf);
+
+  id = local(id);
   
   const char * cbuf = buf.c_str();
   int size = buf.size();
+  int r = extent_protocol::OK;
   //printf("zzz: es: put %lld, bufsz:%u\n", id, buf.size());
-  im->write_file(id, cbuf, size);
+  pthread_mutex_lock(&mx);
+  if (!im->write_file(id, cbuf, size))
+    r = extent_protocol::IOERR;
+  dirs.erase(id);
+  pthread_mutex_unlock(&mx);
   
-  return extent_protocol::OK;
+  return r;
 }
 
 int extent_server::get(extent_protocol::extentid_t id, std::string &buf)
 {
+  if (!can_read())
+    return extent_protocol::NOTPRIMARY;
+
   //printf("zzz: es: get %lld\n", id);
 
-  id &= 0x7fffffff;
+  id = local(id);
 
-  int size = 0;
-  char *cbuf = NULL;
+  pthread_mutex_lock(&mx);
+  im->read_file(id, buf);
+  pthread_mutex_unlock(&mx);
 
-  im->read_file(id, &cbuf, &size);
-  if (size == 0)
-    buf = "";
-  else {
-    buf.assign(cbuf, size);
-    free(cbuf);
+  return extent_protocol::OK;
+}
+
+// get for a client that still has the contents as of version: if they
+// have not changed since, only the attributes are sent back, with
+// NOTMODIFIED. The data and attributes are read together under mx, so
+// r.a.version is the version of r.data.
+int extent_server::get_if_changed(extent_protocol::extentid_t id,
+                                  unsigned int version, extent_protocol::result &r)
+{
+  if (!can_read())
+    return extent_protocol::NOTPRIMARY;
+
+  id = local(id);
+
+  r.ret = extent_protocol::OK;
+  memset(&r.a, 0, sizeof(r.a));
+  pthread_mutex_lock(&mx);
+  im->getattr(id, r.a);
+  if (version != 0 && r.a.version == version) {
+    r.ret = extent_protocol::NOTMODIFIED;
+  } else {
+    im->read_file(id, r.data);
+    im->getattr(id, r.a);
+  }
+  pthread_mutex_unlock(&mx);
+
+  return r.ret;
+}
+
+// get_if_changed that also gives clt a read lease on id for LEASE_TIME.
+// The lease is recorded before the data is read, so a mutation that the
+// reply does not reflect is always followed by a callback. Only the
+// primary hands out leases, as only it sees mutations first.
+int extent_server::get_lease(std::string clt, extent_protocol::extentid_t id,
+                             unsigned int version, extent_protocol::result &r)
+{
+  if (replicated()) {
+    pthread_mutex_lock(&vmx);
+    bool primary = !stale && view == me;
+    pthread_mutex_unlock(&vmx);
+    if (!primary)
+      return extent_protocol::NOTPRIMARY;
   }
 
+  pthread_mutex_lock(&lmx);
+  leases[id][clt] = time(NULL) + LEASE_TIME;
+  pthread_mutex_unlock(&lmx);
+
+  return get_if_changed(id, version, r);
+}
+
+// clt, holding id's lock, is about to change its cached copy of id and
+// write it back later: every other read lease is broken now, as no
+// mutation will reach the server until then. The lock keeps the write
+// lease exclusive, and a reader without a lease must take the lock,
+// which makes clt write back first.
+int extent_server::write_lease(std::string clt, extent_protocol::extentid_t id,
+                               int &)
+{
+  if (replicated()) {
+    pthread_mutex_lock(&vmx);
+    bool primary = !stale && view == me;
+    pthread_mutex_unlock(&vmx);
+    if (!primary)
+      return extent_protocol::NOTPRIMARY;
+  }
+
+  break_leases(id, clt);
   return extent_protocol::OK;
 }
 
 int extent_server::getattr(extent_protocol::extentid_t id, extent_protocol::attr &a)
 {
+  if (!can_read())
+    return extent_protocol::NOTPRIMARY;
+
   //printf("zzz: es: getattr %lld\n", id);
 
-  id &= 0x7fffffff;
+  id = local(id);
   
   extent_protocol::attr attr;
   memset(&attr, 0, sizeof(attr));
+  pthread_mutex_lock(&mx);
   im->getattr(id, attr);
+  pthread_mutex_unlock(&mx);
   a = attr;
 
   return extent_protocol::OK;
 }
 
-int extent_server::remove(extent_protocol::extentid_t id, int &)
+int extent_server::_remove(extent_protocol::extentid_t id, int &)
 {
   //printf("zzz: es: remove %lld\n", id);
 
-  id &= 0x7fffffff;
+  id = local(id);
+  pthread_mutex_lock(&mx);
   im->remove_file(id);
+  dirs.erase(id);
+  pthread_mutex_unlock(&mx);
  
   return extent_protocol::OK;
 }
 
+
+int extent_server::get_range(extent_protocol::extentid_t id, uint32_t off,
+                             uint32_t len, std::string &buf)
+{
+  if (!can_read())
+    return extent_protocol::NOTPRIMARY;
+
+  id = local(id);
+
+  pthread_mutex_lock(&mx);
+  im->read_range(id, off, len, buf);
+  pthread_mutex_unlock(&mx);
+
+  return extent_protocol::OK;
+}
+
+int extent_server::_put_range(extent_protocol::extentid_t id, uint32_t off,
+                              const std::string &buf, int &)
+{
+  if (!range_ok(off, buf.size()))
+    return extent_protocol::IOERR;
+  if (batch_window > 0)
+    return batch_write(extent_protocol::put_range, id, off, buf);
+
+  id = local(id);
+
+  int r = extent_protocol::OK;
+
+  pthread_mutex_lock(&mx);
+  if (!im->write_range(id, off, buf.data(), buf.size()))
+    r = extent_protocol::IOERR;
+  dirs.erase(id);
+  pthread_mutex_unlock(&mx);
+
+  return r;
+}
+
+// Append buf to the file and return its attributes afterwards, so the
+// caller learns where the data went (a.size - buf.size()).
+int extent_server::_append(extent_protocol::extentid_t id, const std::string &buf,
+                           extent_protocol::attr &a)
+{
+  id = local(id);
+
+  uint32_t off;
+  int r = extent_protocol::OK;
+
+  memset(&a, 0, sizeof(a));
+  pthread_mutex_lock(&mx);
+  if (!im->append_file(id, buf.data(), buf.size(), off))
+    r = extent_protocol::IOERR;
+  dirs.erase(id);
+  im->getattr(id, a);
+  pthread_mutex_unlock(&mx);
+
+  return r;
+}
+
+int extent_server::_truncate(extent_protocol::extentid_t id, uint32_t size, int &)
+{
+  id = local(id);
+
+  int r = extent_protocol::OK;
+
+  pthread_mutex_lock(&mx);
+  if (!im->truncate_file(id, size))
+    r = extent_protocol::IOERR;
+  dirs.erase(id);
+  pthread_mutex_unlock(&mx);
+
+  return r;
+}
+
+// Called with mx held. Returns NULL if id is not a directory.
+extent_server::dir_index *
+extent_server::load_dir(extent_protocol::extentid_t id)
+{
+  std::map<extent_protocol::extentid_t, dir_index>::iterator it;
+  extent_protocol::attr a;
+  std::string buf, name;
+  uint32_t inum;
+
+  it = dirs.find(id);
+  if (it != dirs.end())
+    return &it->second;
+
+  memset(&a, 0, sizeof(a));
+  im->getattr(id, a);
+  if (a.type != extent_protocol::T_DIR)
+    return NULL;
+
+  dir_index &d = dirs[id];
+  im->read_file(id, buf);
+  d.nslots = buf.size() / DIRENT_SIZE;
+  for (uint32_t i = 0; i < d.nslots; ++i) {
+    inum = dirent_unpack(buf.data() + i * DIRENT_SIZE, name);
+    if (inum == 0) {
+      d.free_slots.push_back(i);
+    } else {
+      d.slots[name] = i;
+      d.inums[name] = inum;
+    }
+  }
+  return &d;
+}
+
+int extent_server::dir_lookup(extent_protocol::extentid_t id, std::string name,
+                              extent_protocol::extentid_t &ino)
+{
+  if (!can_read())
+    return extent_protocol::NOTPRIMARY;
+
+  id = local(id);
+
+  int r = extent_protocol::NOENT;
+
+  ino = 0;
+  pthread_mutex_lock(&mx);
+  dir_index *d = load_dir(id);
+  if (d == NULL) {
+    r = extent_protocol::IOERR;
+  } else if (d->inums.count(name)) {
+    ino = d->inums[name];
+    r = extent_protocol::OK;
+  }
+  pthread_mutex_unlock(&mx);
+
+  return r;
+}
+
+// Put name -> ino into a free slot of directory id (local), growing it
+// by one slot if none is free. Called with mx held; if the write fails
+// the index is dropped, so d must not be used afterwards.
+int extent_server::dir_link(dir_index *d, uint32_t id, const std::string &name,
+                            extent_protocol::extentid_t ino)
+{
+  char slot[DIRENT_SIZE];
+  uint32_t n;
+
+  if (d->slots.count(name))
+    return extent_protocol::EXIST;
+  if (!d->free_slots.empty()) {
+    n = d->free_slots.back();
+    d->free_slots.pop_back();
+  } else if ((d->nslots + 1) * DIRENT_SIZE <= MAXFILE * BLOCK_SIZE) {
+    n = d->nslots++;
+  } else {
+    printf("es: dir_add: directory %u is full\n", id);
+    return extent_protocol::IOERR;
+  }
+  dirent_pack(slot, (uint32_t)ino, name);
+  if (!im->write_range(id, n * DIRENT_SIZE, slot, DIRENT_SIZE)) {
+    dirs.erase(id);
+    return extent_protocol::IOERR;
+  }
+  d->slots[name] = n;
+  d->inums[name] = (uint32_t)ino;
+  return extent_protocol::OK;
+}
+
+int extent_server::_dir_add(extent_protocol::extentid_t id, std::string name,
+                            extent_protocol::extentid_t ino, int &)
+{
+  id = local(id);
+
+  int r;
+
+  if (name.empty() || name.size() > DIRENT_NAMEMAX || ino == 0)
+    return extent_protocol::IOERR;
+
+  pthread_mutex_lock(&mx);
+  dir_index *d = load_dir(id);
+  if (d == NULL)
+    r = extent_protocol::IOERR;
+  else
+    r = dir_link(d, id, name, ino);
+  pthread_mutex_unlock(&mx);
+
+  return r;
+}
+
+int extent_server::_dir_remove(extent_protocol::extentid_t id, std::string name,
+                               extent_protocol::extentid_t &ino)
+{
+  id = local(id);
+
+  char slot[DIRENT_SIZE];
+  int r = extent_protocol::NOENT;
+
+  ino = 0;
+  pthread_mutex_lock(&mx);
+  dir_index *d = load_dir(id);
+  if (d == NULL) {
+    r = extent_protocol::IOERR;
+  } else if (d->slots.count(name)) {
+    uint32_t i = d->slots[name];
+    ino = d->inums[name];
+    memset(slot, 0, DIRENT_SIZE);
+    if (!im->write_range(id, i * DIRENT_SIZE, slot, DIRENT_SIZE)) {
+      dirs.erase(id);
+      ino = 0;
+      r = extent_protocol::IOERR;
+    } else {
+      d->slots.erase(name);
+      d->inums.erase(name);
+      d->free_slots.push_back(i);
+      r = extent_protocol::OK;
+    }
+  }
+  pthread_mutex_unlock(&mx);
+
+  return r;
+}
+
+// Every entry of a directory together with its inode's attributes, so
+// listing a directory takes one round trip instead of one per entry.
+int extent_server::readdir_plus(extent_protocol::extentid_t id,
+                                std::vector<extent_protocol::dirent_plus> &ents)
+{
+  if (!can_read())
+    return extent_protocol::NOTPRIMARY;
+
+  id = local(id);
+
+  std::map<std::string, uint32_t>::iterator it;
+  extent_protocol::dirent_plus e;
+  int r = extent_protocol::OK;
+
+  pthread_mutex_lock(&mx);
+  dir_index *d = load_dir(id);
+  if (d == NULL) {
+    r = extent_protocol::IOERR;
+  } else {
+    for (it = d->inums.begin(); it != d->inums.end(); ++it) {
+      e.name = it->first;
+      e.inum = it->second;
+      memset(&e.a, 0, sizeof(e.a));
+      // entries on other shards are left with type 0 for the client
+      if (is_local(e.inum))
+        im->getattr(local(e.inum), e.a);
+      ents.push_back(e);
+    }
+  }
+  pthread_mutex_unlock(&mx);
+
+  return r;
+}
+
+// Run the steps of a compound request in order and return one result
+// per step.
+int extent_server::compound(const std::vector<extent_protocol::op> &ops,
+                            std::vector<extent_protocol::result> &res)
+{
+  int tmp;
+
+  res.resize(ops.size());
+  for (uint32_t i = 0; i < ops.size(); ++i) {
+    const extent_protocol::op &o = ops[i];
+    extent_protocol::result &r = res[i];
+    memset(&r.a, 0, sizeof(r.a));
+    r.eid = o.eid;
+
+    switch (o.type) {
+    case extent_protocol::put:
+      r.ret = put(o.eid, o.data, tmp);
+      break;
+    case extent_protocol::get:
+      r.ret = get(o.eid, r.data);
+      break;
+    case extent_protocol::getattr:
+      r.ret = getattr(o.eid, r.a);
+      break;
+    case extent_protocol::remove:
+      r.ret = remove(o.eid, tmp);
+      break;
+    case extent_protocol::create:
+      r.ret = create(o.off, r.eid);
+      break;
+    case extent_protocol::get_range:
+      r.ret = get_range(o.eid, o.off, o.len, r.data);
+      break;
+    case extent_protocol::put_range:
+      r.ret = put_range(o.eid, o.off, o.data, tmp);
+      break;
+    case extent_protocol::truncate:
+      r.ret = truncate(o.eid, o.off, tmp);
+      break;
+    case extent_protocol::append:
+      r.ret = append(o.eid, o.data, r.a);
+      break;
+    default:
+      printf("es: compound: unknown op 0x%x\n", o.type);
+      r.ret = extent_protocol::RPCERR;
+    }
+  }
+
+  return extent_protocol::OK;
+}
+
+// Call back every client but keep with a read lease on id, so none of
+// them goes on reading its cached copy. No lock is held meanwhile; a
+// client that cannot be reached is waited out until its lease runs out.
+void extent_server::break_leases(extent_protocol::extentid_t id, std::string keep)
+{
+  std::map<std::string, time_t> holders;
+  std::map<std::string, time_t>::iterator it;
+  int r;
+
+  pthread_mutex_lock(&lmx);
+  if (leases.count(id)) {
+    holders.swap(leases[id]);
+    leases.erase(id);
+    if (holders.count(keep)) {
+      leases[id][keep] = holders[keep];
+      holders.erase(keep);
+    }
+  }
+  pthread_mutex_unlock(&lmx);
+
+  for (it = holders.begin(); it != holders.end(); ++it) {
+    if (it->second <= time(NULL))
+      continue;
+    handle h(it->first);
+    rpcc *cl = h.safebind();
+    if (cl && cl->call(rextent_protocol::invalidate, id, r, rpcc::to(1000)) == 0)
+      continue;
+    printf("es: cannot call back %s, waiting out its lease on %llu\n",
+           it->first.c_str(), id);
+    while (it->second > time(NULL))
+      sleep(1);
+  }
+}
+
+// Called after a mutation of id that returned ret; if it succeeded the
+// read leases on id are broken before the mutation is answered.
+int extent_server::changed(extent_protocol::extentid_t id, int ret)
+{
+  if (ret == extent_protocol::OK && id != 0)
+    break_leases(id, "");
+  return ret;
+}
+
+// Mutating RPCs. Without replication they go straight to the local
+// implementations; otherwise through mutate(), which forwards them.
+// Either way changed() then breaks the read leases on what they touched.
+
+int extent_server::create(uint32_t type, extent_protocol::extentid_t &id)
+{
+  if (!replicated())
+    return _create(type, id);
+
+  extent_protocol::op o;
+  extent_protocol::result r;
+  o.type = extent_protocol::create;
+  o.eid = 0;
+  o.off = type;
+  o.len = 0;
+  int ret = mutate(o, r);
+  id = r.eid;
+  return ret;
+}
+
+int extent_server::create_v2(uint32_t type, extent_protocol::extentid_t parent,
+                             std::string name, extent_protocol::result &r)
+{
+  if (!replicated())
+    return changed(parent, _create_v2(type, parent, name, r));
+
+  extent_protocol::op o;
+  o.type = extent_protocol::create_v2;
+  o.eid = parent;
+  o.off = type;
+  o.len = 0;
+  o.data = name;
+  return changed(parent, mutate(o, r));
+}
+
+int extent_server::put(extent_protocol::extentid_t id, const std::string &buf, int &tmp)
+{
+  if (!replicated())
+    return changed(id, _put(id, buf, tmp));
+
+  extent_protocol::op o;
+  extent_protocol::result r;
+  o.type = extent_protocol::put;
+  o.eid = id;
+  o.off = o.len = 0;
+  o.data = buf;
+  return changed(id, mutate(o, r));
+}
+
+int extent_server::remove(extent_protocol::extentid_t id, int &tmp)
+{
+  if (!replicated())
+    return changed(id, _remove(id, tmp));
+
+  extent_protocol::op o;
+  extent_protocol::result r;
+  o.type = extent_protocol::remove;
+  o.eid = id;
+  o.off = o.len = 0;
+  return changed(id, mutate(o, r));
+}
+
+int extent_server::put_range(extent_protocol::extentid_t id, uint32_t off,
+                             const std::string &buf, int &tmp)
+{
+  if (!range_ok(off, buf.size()))
+    return extent_protocol::IOERR;
+  if (!replicated())
+    return changed(id, _put_range(id, off, buf, tmp));
+
+  extent_protocol::op o;
+  extent_protocol::result r;
+  o.type = extent_protocol::put_range;
+  o.eid = id;
+  o.off = off;
+  o.len = 0;
+  o.data = buf;
+  return changed(id, mutate(o, r));
+}
+
+int extent_server::append(extent_protocol::extentid_t id, const std::string &buf,
+                          extent_protocol::attr &a)
+{
+  if (!replicated())
+    return changed(id, _append(id, buf, a));
+
+  extent_protocol::op o;
+  extent_protocol::result r;
+  o.type = extent_protocol::append;
+  o.eid = id;
+  o.off = o.len = 0;
+  o.data = buf;
+  int ret = changed(id, mutate(o, r));
+  a = r.a;
+  return ret;
+}
+
+int extent_server::truncate(extent_protocol::extentid_t id, uint32_t size, int &tmp)
+{
+  if (!replicated())
+    return changed(id, _truncate(id, size, tmp));
+
+  extent_protocol::op o;
+  extent_protocol::result r;
+  o.type = extent_protocol::truncate;
+  o.eid = id;
+  o.off = size;
+  o.len = 0;
+  return changed(id, mutate(o, r));
+}
+
+int extent_server::dir_add(extent_protocol::extentid_t id, std::string name,
+                           extent_protocol::extentid_t ino, int &tmp)
+{
+  if (!replicated())
+    return changed(id, _dir_add(id, name, ino, tmp));
+
+  extent_protocol::op o;
+  extent_protocol::result r;
+  o.type = extent_protocol::dir_add;
+  o.eid = id;
+  o.off = (uint32_t)ino;
+  o.len = 0;
+  o.data = name;
+  return changed(id, mutate(o, r));
+}
+
+int extent_server::dir_remove(extent_protocol::extentid_t id, std::string name,
+                              extent_protocol::extentid_t &ino)
+{
+  if (!replicated())
+    return changed(id, _dir_remove(id, name, ino));
+
+  extent_protocol::op o;
+  extent_protocol::result r;
+  o.type = extent_protocol::dir_remove;
+  o.eid = id;
+  o.off = o.len = 0;
+  o.data = name;
+  int ret = changed(id, mutate(o, r));
+  ino = r.eid;
+  return ret;
+}
+
+int
+extent_server::batch_write(uint32_t type, extent_protocol::extentid_t id,
+                           uint32_t off, const std::string &data)
+{
+  batch_req req;
+
+  req.type = type;
+  req.eid = id;
+  req.off = off;
+  req.data = &data;
+  req.ret = extent_protocol::OK;
+  req.done = false;
+  pthread_mutex_lock(&bmx);
+  batch_q.push_back(&req);
+  pthread_cond_signal(&batch_cv);
+  while (!req.done)
+    pthread_cond_wait(&done_cv, &bmx);
+  pthread_mutex_unlock(&bmx);
+  return req.ret;
+}
+
+void
+extent_server::committer()
+{
+  std::vector<batch_req *> b;
+  struct timespec deadline;
+  struct timeval now;
+
+  while (true) {
+    pthread_mutex_lock(&bmx);
+    while (batch_q.empty())
+      pthread_cond_wait(&batch_cv, &bmx);
+
+    // let the window fill up, but stop early once every rpc thread that
+    // could be writing is already waiting here
+    gettimeofday(&now, NULL);
+    deadline.tv_sec = now.tv_sec + batch_window / 1000;
+    deadline.tv_nsec = now.tv_usec * 1000 + (batch_window % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000L;
+    }
+    while (batch_q.size() < BATCH_MAX &&
+           pthread_cond_timedwait(&batch_cv, &bmx, &deadline) != ETIMEDOUT)
+      ;
+    b.swap(batch_q);
+    pthread_mutex_unlock(&bmx);
+
+    commit(b);
+
+    pthread_mutex_lock(&bmx);
+    for (uint32_t i = 0; i < b.size(); ++i)
+      b[i]->done = true;
+    pthread_cond_broadcast(&done_cv);
+    pthread_mutex_unlock(&bmx);
+    b.clear();
+  }
+}
+
+// One write left after folding a batch: the whole file, or a range,
+// and the statuses of the requests folded into it. The bytes are the
+// first request's own (src) until a second one is folded in.
+struct folded_write {
+  bool whole;
+  uint32_t off;
+  const std::string *src;
+  std::string data;
+  std::vector<int *> rets;
+
+  const std::string &bytes() const { return src != NULL ? *src : data; }
+};
+
+// Fold a range write into the last pending write of the same file if
+// the two touch; later bytes win.
+static bool
+fold_range(folded_write &last, uint32_t off, const std::string &data)
+{
+  uint32_t end = last.off + last.bytes().size();
+  bool after = last.whole || (off >= last.off && off <= end);
+
+  if (!after && (off >= last.off || off + data.size() < last.off))
+    return false;
+  if (last.src != NULL) {
+    last.data = *last.src;
+    last.src = NULL;
+  }
+
+  if (after) {
+    if (off - last.off > last.data.size())
+      last.data.append(off - last.off - last.data.size(), (char)0);
+    if (off - last.off + data.size() > last.data.size())
+      last.data.resize(off - last.off + data.size());
+    last.data.replace(off - last.off, data.size(), data);
+    return true;
+  }
+  std::string merged(data);
+  if (off + data.size() < end)
+    merged.append(last.data, off + data.size() - last.off, std::string::npos);
+  last.off = off;
+  last.data.swap(merged);
+  return true;
+}
+
+void
+extent_server::commit(const std::vector<batch_req *> &b)
+{
+  // per inode, in arrival order; a whole-file put replaces everything
+  // queued for that inode before it
+  std::map<uint32_t, std::vector<folded_write> > files;
+  std::map<uint32_t, std::vector<folded_write> >::iterator it;
+
+  for (uint32_t i = 0; i < b.size(); ++i) {
+    batch_req *q = b[i];
+    std::vector<folded_write> &w = files[local(q->eid)];
+    if (q->type == extent_protocol::put) {
+      // what the put replaces lives or dies with it
+      std::vector<int *> rets;
+      for (uint32_t j = 0; j < w.size(); ++j)
+        rets.insert(rets.end(), w[j].rets.begin(), w[j].rets.end());
+      w.clear();
+      w.push_back(folded_write());
+      w.back().whole = true;
+      w.back().off = 0;
+      w.back().src = q->data;
+      w.back().rets.swap(rets);
+    } else if (w.empty() || !fold_range(w.back(), q->off, *q->data)) {
+      w.push_back(folded_write());
+      w.back().whole = false;
+      w.back().off = q->off;
+      w.back().src = q->data;
+    }
+    w.back().rets.push_back(&q->ret);
+  }
+
+  pthread_mutex_lock(&mx);
+  im->begin_batch();
+  for (it = files.begin(); it != files.end(); ++it) {
+    for (uint32_t i = 0; i < it->second.size(); ++i) {
+      folded_write &f = it->second[i];
+      const std::string &d = f.bytes();
+      bool ok;
+      if (f.whole)
+        ok = im->write_file(it->first, d.data(), d.size());
+      else
+        ok = im->write_range(it->first, f.off, d.data(), d.size());
+      for (uint32_t j = 0; !ok && j < f.rets.size(); ++j)
+        *f.rets[j] = extent_protocol::IOERR;
+    }
+    dirs.erase(it->first);
+  }
+  if (!im->end_batch()) {
+    // the inode table or bitmap did not make it to disk
+    for (uint32_t i = 0; i < b.size(); ++i)
+      b[i]->ret = extent_protocol::IOERR;
+  }
+  pthread_mutex_unlock(&mx);
+}
+
+void
+extent_server::set_replicas(std::string list, std::string self)
+{
+  std::istringstream ist(list);
+  std::string r;
+  bool found = false;
+
+  replicas.clear();
+  while (std::getline(ist, r, '|')) {
+    // "port" and "host:port" entries both match a bare port
+    if (r == self || (r.size() > self.size() &&
+        r.compare(r.size() - self.size() - 1, std::string::npos, ":" + self) == 0)) {
+      me = replicas.size();
+      found = true;
+    }
+    replicas.push_back(r);
+  }
+  if (!replicated())
+    return;
+  if (!found) {
+    printf("es: %s is not in replica list %s\n", self.c_str(), list.c_str());
+    exit(1);
+  }
+
+  if (batch_window > 0) {
+    // mutations are serialized for forwarding; nothing would be batched
+    printf("es: group commit is off for replicated servers\n");
+    batch_window = 0;
+  }
+
+  view = 0;
+  last_hb = time(NULL);
+  in_sync.assign(replicas.size(), true);
+  last_ok.assign(replicas.size(), time(NULL));
+  printf("es: replica %u of %u, %s\n", me, (uint32_t)replicas.size(),
+         me == view ? "primary" : "backup");
+
+  pthread_t th;
+  VERIFY(pthread_create(&th, NULL, replica_thread, (void *)this) == 0);
+}
+
+bool
+extent_server::can_read()
+{
+  bool ok;
+
+  if (!replicated())
+    return true;
+  pthread_mutex_lock(&vmx);
+  ok = !stale && (view == me || time(NULL) - last_hb < REPL_LEASE);
+  pthread_mutex_unlock(&vmx);
+  return ok;
+}
+
+// Apply one mutation locally.
+int
+extent_server::apply(const extent_protocol::op &o, extent_protocol::result &r)
+{
+  int tmp;
+
+  r.eid = o.eid;
+  switch (o.type) {
+  case extent_protocol::create:
+    r.ret = _create(o.off, r.eid);
+    break;
+  case extent_protocol::create_v2:
+    _create_v2(o.off, o.eid, o.data, r);
+    break;
+  case extent_protocol::put:
+    r.ret = _put(o.eid, o.data, tmp);
+    break;
+  case extent_protocol::remove:
+    r.ret = _remove(o.eid, tmp);
+    break;
+  case extent_protocol::put_range:
+    r.ret = _put_range(o.eid, o.off, o.data, tmp);
+    break;
+  case extent_protocol::truncate:
+    r.ret = _truncate(o.eid, o.off, tmp);
+    break;
+  case extent_protocol::append:
+    r.ret = _append(o.eid, o.data, r.a);
+    break;
+  case extent_protocol::dir_add:
+    r.ret = _dir_add(o.eid, o.data, o.off, tmp);
+    break;
+  case extent_protocol::dir_remove:
+    r.ret = _dir_remove(o.eid, o.data, r.eid);
+    break;
+  default:
+    printf("es: apply: unknown op 0x%x\n", o.type);
+    r.ret = extent_protocol::RPCERR;
+  }
+  return r.ret;
+}
+
+// Primary side of a mutation: apply it, then have every backup apply it
+// before answering.
+int
+extent_server::mutate(extent_protocol::op &o, extent_protocol::result &r)
+{
+  int ret;
+  time_t wait;
+
+  pthread_mutex_lock(&rmx);
+  pthread_mutex_lock(&vmx);
+  bool primary = !stale && view == me;
+  pthread_mutex_unlock(&vmx);
+  if (!primary) {
+    pthread_mutex_unlock(&rmx);
+    return extent_protocol::NOTPRIMARY;
+  }
+
+  ret = apply(o, r);
+  if (ret == extent_protocol::OK) {
+    // backups must allocate the same inum
+    if (o.type == extent_protocol::create)
+      o.eid = r.eid;
+    else if (o.type == extent_protocol::create_v2)
+      o.len = r.eid;
+    seq++;
+    forward(o);
+  }
+
+  // a backup dropped just now may still answer reads from its old state
+  // until its lease runs out; do not let the client see this write first
+  wait = fence - time(NULL);
+  if (wait > 0)
+    sleep(wait);
+  pthread_mutex_unlock(&rmx);
+  return ret;
+}
+
+// Called with rmx held.
+void
+extent_server::forward(const extent_protocol::op &o)
+{
+  int ret, tmp;
+
+  for (uint32_t i = 0; i < replicas.size(); ++i) {
+    if (i == me || !in_sync[i])
+      continue;
+    handle h(replicas[i]);
+    rpcc *cl = h.safebind();
+    if (cl)
+      ret = cl->call(extent_protocol::replicate, view, seq, o, tmp, rpcc::to(1000));
+    else
+      ret = extent_protocol::RPCERR;
+
+    if (ret == extent_protocol::OK) {
+      last_ok[i] = time(NULL);
+    } else if (ret == extent_protocol::NOTPRIMARY) {
+      // a backup has taken over; stop acting as primary
+      printf("es: replica %s has a newer primary, stepping down\n", replicas[i].c_str());
+      pthread_mutex_lock(&vmx);
+      stale = true;
+      pthread_mutex_unlock(&vmx);
+      return;
+    } else {
+      printf("es: dropping replica %s (%d)\n", replicas[i].c_str(), ret);
+      in_sync[i] = false;
+      if (last_ok[i] + REPL_LEASE > fence)
+        fence = last_ok[i] + REPL_LEASE;
+    }
+  }
+}
+
+// Called with rmx held, so seq is not moving.
+void
+extent_server::ping_backups()
+{
+  int ret, tmp;
+
+  for (uint32_t i = 0; i < replicas.size(); ++i) {
+    if (i == me)
+      continue;
+    // dropped backups are pinged too, so they learn that they are stale
+    // and never take over
+    handle h(replicas[i]);
+    rpcc *cl = h.safebind();
+    if (cl)
+      ret = cl->call(extent_protocol::heartbeat, view, seq, tmp, rpcc::to(1000));
+    else
+      ret = extent_protocol::RPCERR;
+
+    if (ret == extent_protocol::OK && in_sync[i]) {
+      last_ok[i] = time(NULL);
+    } else if (ret == extent_protocol::NOTPRIMARY) {
+      printf("es: replica %s has a newer primary, stepping down\n", replicas[i].c_str());
+      pthread_mutex_lock(&vmx);
+      stale = true;
+      pthread_mutex_unlock(&vmx);
+      return;
+    } else if (ret != extent_protocol::OK && in_sync[i]) {
+      printf("es: dropping replica %s (%d)\n", replicas[i].c_str(), ret);
+      in_sync[i] = false;
+      if (last_ok[i] + REPL_LEASE > fence)
+        fence = last_ok[i] + REPL_LEASE;
+    }
+  }
+}
+
+// The primary pings its backups; a backup watches for a silent primary
+// and takes over when its turn comes.
+void
+extent_server::replica_loop()
+{
+  while (true) {
+    sleep(REPL_HEARTBEAT);
+
+    pthread_mutex_lock(&vmx);
+    bool out = stale;
+    uint32_t v = view;
+    time_t silent = time(NULL) - last_hb;
+    pthread_mutex_unlock(&vmx);
+    if (out)
+      continue;
+
+    if (v == me) {
+      pthread_mutex_lock(&rmx);
+      ping_backups();
+      pthread_mutex_unlock(&rmx);
+    } else if (me > v && silent > (time_t)(REPL_FAILOVER * (me - v))) {
+      // every replica ranked before us is silent too, or it would have
+      // taken over already and pinged us
+      printf("es: primary %s silent for %ld s, taking over\n",
+             replicas[v].c_str(), (long)silent);
+      pthread_mutex_lock(&rmx);
+      pthread_mutex_lock(&vmx);
+      view = me;
+      pthread_mutex_unlock(&vmx);
+      for (uint32_t i = 0; i < replicas.size(); ++i) {
+        in_sync[i] = (i != v);
+        last_ok[i] = time(NULL);
+      }
+      ping_backups();
+      pthread_mutex_unlock(&rmx);
+    }
+  }
+}
+
+// Backup side: apply the primary's mutations strictly in sequence.
+int extent_server::replicate(uint32_t v, uint32_t s, const extent_protocol::op &o, int &)
+{
+  extent_protocol::result r;
+
+  pthread_mutex_lock(&vmx);
+  if (v < view) {
+    pthread_mutex_unlock(&vmx);
+    return extent_protocol::NOTPRIMARY;
+  }
+  if (stale) {
+    pthread_mutex_unlock(&vmx);
+    return extent_protocol::IOERR;
+  }
+  view = v;
+  last_hb = time(NULL);
+  if (s <= seq) {
+    // a retransmission we have already applied
+    pthread_mutex_unlock(&vmx);
+    return extent_protocol::OK;
+  }
+  if (s != seq + 1) {
+    printf("es: missed mutations %u..%u, no longer a usable replica\n", seq + 1, s - 1);
+    stale = true;
+    pthread_mutex_unlock(&vmx);
+    return extent_protocol::IOERR;
+  }
+  pthread_mutex_unlock(&vmx);
+
+  apply(o, r);
+  if ((o.type == extent_protocol::create && r.eid != o.eid) ||
+      (o.type == extent_protocol::create_v2 && r.eid != o.len)) {
+    printf("es: create gave %llu, primary has %llu\n", r.eid,
+           o.type == extent_protocol::create ? o.eid : o.len);
+    pthread_mutex_lock(&vmx);
+    stale = true;
+    pthread_mutex_unlock(&vmx);
+    return extent_protocol::IOERR;
+  }
+
+  pthread_mutex_lock(&vmx);
+  seq = s;
+  pthread_mutex_unlock(&vmx);
+  return extent_protocol::OK;
+}
+
+// Every run starts from an empty disk and numbers inode versions anew,
+// so an (inum, version) pair kept from an earlier run may name other
+// contents now. A client that keeps copies across runs of the server
+// compares this run's id with the one it saved them under.
+int extent_server::boot_id(int, unsigned long long &b)
+{
+  b = boot;
+  return extent_protocol::OK;
+}
+
+int extent_server::heartbeat(uint32_t v, uint32_t s, int &)
+{
+  int ret = extent_protocol::OK;
+
+  pthread_mutex_lock(&vmx);
+  if (v < view) {
+    ret = extent_protocol::NOTPRIMARY;
+  } else {
+    view = v;
+    last_hb = time(NULL);
+    if (s != seq && !stale) {
+      printf("es: at mutation %u, primary at %u; no longer a usable replica\n", seq, s);
+      stale = true;
+    }
+    if (stale)
+      ret = extent_protocol::IOERR;
+  }
+  pthread_mutex_unlock(&vmx);
+  return ret;
+}
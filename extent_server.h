@@ -5,6 +5,7 @@
 
 #include <string>
 #include <map>
+#include <vector>
 #include "extent_protocol.h"
 #include "inode_manager.h"
 
@@ -18,15 +19,148 @@ class extent_server {
   std::map <extent_protocol::extentid_t, extent_t> extents;
 #endif
   inode_manager *im;
+  // this run's incarnation, see boot_id()
+  unsigned long long boot;
+  // this server is shard `shard' of `nshards'; see local()
+  uint32_t shard;
+  uint32_t nshards;
+  // serializes RPC handlers and the defragmenter on im
+  pthread_mutex_t mx;
+
+  // In-memory index of a directory's slots, built on first use and
+  // dropped whenever the directory is written other than by dir_*.
+  struct dir_index {
+    std::map<std::string, uint32_t> slots;  // name -> slot number
+    std::map<std::string, uint32_t> inums;  // name -> inum
+    std::vector<uint32_t> free_slots;
+    uint32_t nslots;
+  };
+  std::map<extent_protocol::extentid_t, dir_index> dirs;
+  dir_index *load_dir(extent_protocol::extentid_t id);
+  int dir_link(dir_index *d, uint32_t id, const std::string &name,
+               extent_protocol::extentid_t ino);
+
+  // Replication; unused unless set_replicas() is given more than one
+  // server. replicas are in failover order and the primary is
+  // replicas[view]. Mutations are applied and forwarded to the backups
+  // one at a time under rmx, so every backup applies them in the
+  // primary's order and is up to date when the client sees the reply.
+  std::vector<std::string> replicas;
+  uint32_t me;
+  uint32_t view;
+  uint32_t seq;               // mutations applied so far
+  bool stale;                 // missed a mutation or was deposed
+  time_t last_hb;             // backup: last contact from the primary
+  std::vector<bool> in_sync;  // primary: backups that get mutations
+  std::vector<time_t> last_ok;  // primary: last reply from each backup
+  time_t fence;               // primary: dropped backups may read until then
+  pthread_mutex_t rmx;        // orders mutations and their forwarding
+  pthread_mutex_t vmx;        // protects the fields above
+
+  // Group commit, on when YFS_BATCH_WINDOW=<ms> is set (and the server
+  // is not replicated): put and put_range callers queue their write and
+  // wait; the committer applies everything that arrived within the
+  // window in one pass under mx and then wakes them all, each with the
+  // status of its own write. data is the caller's, which stays put until
+  // done is set.
+  struct batch_req {
+    uint32_t type;              // extent_protocol::put or put_range
+    extent_protocol::extentid_t eid;
+    uint32_t off;
+    const std::string *data;
+    int ret;
+    bool done;
+  };
+  int batch_window;
+  std::vector<batch_req *> batch_q;
+  pthread_mutex_t bmx;
+  pthread_cond_t batch_cv;    // committer waits for the first write
+  pthread_cond_t done_cv;     // callers wait for their batch
+  int batch_write(uint32_t type, extent_protocol::extentid_t id, uint32_t off,
+                  const std::string &data);
+  void commit(const std::vector<batch_req *> &b);
+
+  // Read leases handed out by get_lease: extent -> client -> expiry.
+  std::map<extent_protocol::extentid_t, std::map<std::string, time_t> > leases;
+  pthread_mutex_t lmx;
+  void break_leases(extent_protocol::extentid_t id, std::string keep);
+  int changed(extent_protocol::extentid_t id, int ret);
+
+  bool replicated() { return replicas.size() > 1; }
+  bool can_read();
+  int apply(const extent_protocol::op &o, extent_protocol::result &r);
+  int mutate(extent_protocol::op &o, extent_protocol::result &r);
+  void forward(const extent_protocol::op &o);
+  void ping_backups();
+
+  int _create(uint32_t type, extent_protocol::extentid_t &id);
+  int _create_v2(uint32_t type, extent_protocol::extentid_t parent,
+                 std::string name, extent_protocol::result &r);
+  int _put(extent_protocol::extentid_t id, const std::string &, int &);
+  int _remove(extent_protocol::extentid_t id, int &);
+  int _put_range(extent_protocol::extentid_t id, uint32_t off, const std::string &, int &);
+  int _truncate(extent_protocol::extentid_t id, uint32_t size, int &);
+  int _append(extent_protocol::extentid_t id, const std::string &, extent_protocol::attr &);
+  int _dir_add(extent_protocol::extentid_t id, std::string name,
+               extent_protocol::extentid_t ino, int &);
+  int _dir_remove(extent_protocol::extentid_t id, std::string name,
+                  extent_protocol::extentid_t &ino);
 
  public:
-  extent_server();
+  struct frag_stat {
+    uint32_t files;       // files with data
+    uint32_t fragmented;  // files whose blocks are not one contiguous run
+    uint32_t blocks;
+    uint32_t runs;
+  };
+
+  extent_server(uint32_t shard = 0, uint32_t nshards = 1);
+
+  // Inums seen by clients are global: shard k of n owns the global inums
+  // g with (g-1) % n == k, stored locally as inode (g-1)/n + 1. With one
+  // shard both are the same, and the root (1) is always on shard 0.
+  uint32_t local(extent_protocol::extentid_t id);
+  extent_protocol::extentid_t global(uint32_t inum);
+  bool is_local(extent_protocol::extentid_t id);
+
+  // list is the '|'-separated replica group of this shard, self is
+  // this server's own entry in it
+  void set_replicas(std::string list, std::string self);
+  void replica_loop();
+  void committer();
+
+  void frag_stats(frag_stat &st);
+  void defrag(int interval);
 
   int create(uint32_t type, extent_protocol::extentid_t &id);
-  int put(extent_protocol::extentid_t id, std::string, int &);
+  int create_v2(uint32_t type, extent_protocol::extentid_t parent,
+                std::string name, extent_protocol::result &r);
+  int put(extent_protocol::extentid_t id, const std::string &, int &);
   int get(extent_protocol::extentid_t id, std::string &);
   int getattr(extent_protocol::extentid_t id, extent_protocol::attr &);
+  int get_if_changed(extent_protocol::extentid_t id, unsigned int version,
+                     extent_protocol::result &r);
+  int get_lease(std::string clt, extent_protocol::extentid_t id,
+                unsigned int version, extent_protocol::result &r);
+  int write_lease(std::string clt, extent_protocol::extentid_t id, int &);
   int remove(extent_protocol::extentid_t id, int &);
+  int get_range(extent_protocol::extentid_t id, uint32_t off, uint32_t len, std::string &);
+  int put_range(extent_protocol::extentid_t id, uint32_t off, const std::string &, int &);
+  int truncate(extent_protocol::extentid_t id, uint32_t size, int &);
+  int append(extent_protocol::extentid_t id, const std::string &, extent_protocol::attr &);
+  int dir_lookup(extent_protocol::extentid_t id, std::string name,
+                 extent_protocol::extentid_t &ino);
+  int dir_add(extent_protocol::extentid_t id, std::string name,
+              extent_protocol::extentid_t ino, int &);
+  int dir_remove(extent_protocol::extentid_t id, std::string name,
+                 extent_protocol::extentid_t &ino);
+  int readdir_plus(extent_protocol::extentid_t id,
+                   std::vector<extent_protocol::dirent_plus> &ents);
+  int compound(const std::vector<extent_protocol::op> &ops,
+               std::vector<extent_protocol::result> &res);
+  int replicate(uint32_t v, uint32_t s, const extent_protocol::op &o, int &);
+  int heartbeat(uint32_t v, uint32_t s, int &);
+  int boot_id(int, unsigned long long &);
 };
 
 #endif 
@@ -10,11 +10,20 @@ int
 main(int argc, char *argv[])
 {
   int count = 0;
+  int shard = 0, nshards = 1;
 
-  if(argc != 2){
-    fprintf(stderr, "Usage: %s port\n", argv[0]);
+  if(argc != 2 && argc != 4){
+    fprintf(stderr, "Usage: %s port [shard nshards]\n", argv[0]);
     exit(1);
   }
+  if(argc == 4){
+    shard = atoi(argv[2]);
+    nshards = atoi(argv[3]);
+    if(nshards < 1 || shard < 0 || shard >= nshards){
+      fprintf(stderr, "%s: bad shard %d of %d\n", argv[0], shard, nshards);
+      exit(1);
+    }
+  }
 
   setvbuf(stdout, NULL, _IONBF, 0);
 
@@ -24,13 +33,36 @@ main(int argc, char *argv[])
   }
 
   rpcs server(atoi(argv[1]), count);
-  extent_server ls;
+  extent_server ls(shard, nshards);
+
+  // YFS_REPLICAS="port|port|..." lists this shard's replicas, the
+  // initial primary first
+  char *replicas_env = getenv("YFS_REPLICAS");
+  if(replicas_env != NULL){
+    ls.set_replicas(replicas_env, argv[1]);
+  }
 
   server.reg(extent_protocol::get, &ls, &extent_server::get);
   server.reg(extent_protocol::getattr, &ls, &extent_server::getattr);
+  server.reg(extent_protocol::get_if_changed, &ls, &extent_server::get_if_changed);
+  server.reg(extent_protocol::get_lease, &ls, &extent_server::get_lease);
+  server.reg(extent_protocol::write_lease, &ls, &extent_server::write_lease);
   server.reg(extent_protocol::put, &ls, &extent_server::put);
   server.reg(extent_protocol::remove, &ls, &extent_server::remove);
   server.reg(extent_protocol::create, &ls, &extent_server::create);
+  server.reg(extent_protocol::create_v2, &ls, &extent_server::create_v2);
+  server.reg(extent_protocol::get_range, &ls, &extent_server::get_range);
+  server.reg(extent_protocol::put_range, &ls, &extent_server::put_range);
+  server.reg(extent_protocol::truncate, &ls, &extent_server::truncate);
+  server.reg(extent_protocol::append, &ls, &extent_server::append);
+  server.reg(extent_protocol::compound, &ls, &extent_server::compound);
+  server.reg(extent_protocol::dir_lookup, &ls, &extent_server::dir_lookup);
+  server.reg(extent_protocol::dir_add, &ls, &extent_server::dir_add);
+  server.reg(extent_protocol::dir_remove, &ls, &extent_server::dir_remove);
+  server.reg(extent_protocol::readdir_plus, &ls, &extent_server::readdir_plus);
+  server.reg(extent_protocol::replicate, &ls, &extent_server::replicate);
+  server.reg(extent_protocol::heartbeat, &ls, &extent_server::heartbeat);
+  server.reg(extent_protocol::boot_id, &ls, &extent_server::boot_id);
 
   while(1)
     sleep(1000);
@@ -137,7 +137,7 @@ fuseserver_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
         yfs_client::inum inum = ino; // req->in.h.nodeid;
         ret = yfs->setattr(inum, attr->st_size);
         if(ret != yfs_client::OK) {
-            fuse_reply_err(req, ENOENT);
+            fuse_reply_err(req, ret == yfs_client::FBIG ? EFBIG : ENOENT);
             return;
         }
 
@@ -234,7 +234,7 @@ fuseserver_write(fuse_req_t req, fuse_ino_t ino,
 
     ret = yfs->write(inum, size, off, buf, bytes_written);
     if (ret != yfs_client::OK) {
-        fuse_reply_err(req, ENOENT);
+        fuse_reply_err(req, ret == yfs_client::FBIG ? EFBIG : ENOENT);
         return;
     }
 
@@ -390,7 +390,8 @@ struct dirbuf {
     size_t size;
 };
 
-void dirbuf_add(struct dirbuf *b, const char *name, fuse_ino_t ino)
+void dirbuf_add(struct dirbuf *b, const char *name, fuse_ino_t ino,
+        mode_t mode = 0)
 {
     struct stat stbuf;
     size_t oldsize = b->size;
@@ -398,6 +399,7 @@ void dirbuf_add(struct dirbuf *b, const char *name, fuse_ino_t ino)
     b->p = (char *) realloc(b->p, b->size);
     memset(&stbuf, 0, sizeof(stbuf));
     stbuf.st_ino = ino;
+    stbuf.st_mode = mode;
     fuse_add_dirent(b->p + oldsize, name, &stbuf, b->size);
 }
 
@@ -445,12 +447,14 @@ fuseserver_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
      * and add it to the b data structure using dirbuf_add. 
      */
 
+    // FUSE 2.5 has no readdirplus; readdir_plus instead fetches every
+    // entry's attributes in the same reply and caches them, so the
+    // lookup/getattr calls of an "ls -l" that follows need no extent RPCs.
     yfs_client::status ret;
-    yfs_client::dirent dirent;
-    std::list<yfs_client::dirent> list;
-    std::list<yfs_client::dirent>::iterator it;
+    std::list<yfs_client::dirent_plus> list;
+    std::list<yfs_client::dirent_plus>::iterator it;
 
-    ret = yfs->readdir(inum, list);
+    ret = yfs->readdir_plus(inum, list);
     if(ret != yfs_client::OK) {
         fuse_reply_err(req, ENOENT);
         //fuse_reply_err(req, ENOTDIR);
@@ -458,7 +462,8 @@ fuseserver_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
     }
 
     for(it = list.begin(); it != list.end(); ++it)
-        dirbuf_add(&b, (*it).name.c_str(), (fuse_ino_t)(*it).inum);
+        dirbuf_add(&b, (*it).name.c_str(), (fuse_ino_t)(*it).inum,
+                (*it).isfile ? S_IFREG : S_IFDIR);
 
     reply_buf_limited(req, b.p, b.size, off, size);
     free(b.p);
@@ -572,7 +577,7 @@ fuseserver_statfs(fuse_req_t req)
 
     memset(&buf, 0, sizeof(buf));
 
-    buf.f_namemax = 255;
+    buf.f_namemax = DIRENT_NAMEMAX;
     buf.f_bsize = 512;
 
     fuse_reply_statfs(req, &buf);
@@ -677,6 +682,8 @@ main(int argc, char *argv[])
     fuse_session_destroy(se);
     close(fd);
     fuse_unmount(mountpoint);
+    // lets the extent cache save itself, if it is kept on disk
+    yfs->shutdown();
 
     return err ? 1 : 0;
 }
@@ -1,16 +1,26 @@
 #include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
 #include "inode_manager.h"
 #include "utils.h"
 
 // disk layer -----------------------------------------
 
-disk::disk()
+void
+disk::write_blocks(blockid_t id, const char *buf, uint32_t n)
+{
+  for (uint32_t i = 0; i < n; ++i)
+    write_block(id + i, buf + i * BLOCK_SIZE);
+}
+
+mem_disk::mem_disk()
 {
   bzero(blocks, sizeof(blocks));
 }
 
 void
-disk::read_block(blockid_t id, char *buf)
+mem_disk::read_block(blockid_t id, char *buf)
 {
   if (id < 0 || id >= BLOCK_NUM || buf == NULL)
     return;
@@ -19,7 +29,7 @@ disk::read_block(blockid_t id, char *buf)
 }
 
 void
-disk::write_block(blockid_t id, const char *buf)
+mem_disk::write_block(blockid_t id, const char *buf)
 {
   if (id < 0 || id >= BLOCK_NUM || buf == NULL)
     return;
@@ -27,6 +37,224 @@ disk::write_block(blockid_t id, const char *buf)
   memcpy(blocks[id], buf, BLOCK_SIZE);
 }
 
+void
+mem_disk::write_blocks(blockid_t id, const char *buf, uint32_t n)
+{
+  if (id >= BLOCK_NUM || n > BLOCK_NUM - id || buf == NULL)
+    return;
+
+  memcpy(blocks[id], buf, n * BLOCK_SIZE);
+}
+
+void *
+tier_migrate_thread(void *d)
+{
+  tiered_disk *td = (tiered_disk *)d;
+  char *interval_env = getenv("YFS_TIER_INTERVAL");
+  td->migrate(interval_env != NULL && atoi(interval_env) > 0 ? atoi(interval_env) : 1);
+  pthread_exit(NULL);
+}
+
+tiered_disk::tiered_disk(const char *path, uint32_t ram_blocks)
+{
+  // the image is formatted from scratch, like the in-memory disk
+  fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0 || ftruncate(fd, (off_t)BLOCK_NUM * BLOCK_SIZE) < 0) {
+    printf("\tim: cannot open tier image %s\n", path);
+    exit(1);
+  }
+
+  // room for the metadata block_manager pins, and at least a little
+  // for data blocks
+  nslots = ram_blocks;
+  if (nslots < DBH(BLOCK_NUM) + 64)
+    nslots = DBH(BLOCK_NUM) + 64;
+  if (nslots > BLOCK_NUM)
+    nslots = BLOCK_NUM;
+  ram = (char *)calloc(nslots, BLOCK_SIZE);
+  VERIFY(ram != NULL);
+
+  slot.assign(BLOCK_NUM, TIER_NOSLOT);
+  slot_owner.assign(nslots, 0);
+  heat.assign(BLOCK_NUM, 0);
+  pinned.assign(BLOCK_NUM, false);
+  hand = 0;
+  for (uint32_t s = nslots; s > 0; --s)
+    free_slots.push_back(s - 1);
+  VERIFY(pthread_mutex_init(&mx, NULL) == 0);
+  printf("\tim: tiered disk, %u RAM blocks, image %s\n", nslots, path);
+
+  pthread_t th;
+  VERIFY(pthread_create(&th, NULL, tier_migrate_thread, (void *)this) == 0);
+}
+
+void
+tiered_disk::read_block(blockid_t id, char *buf)
+{
+  if (id >= BLOCK_NUM || buf == NULL)
+    return;
+
+  pthread_mutex_lock(&mx);
+  if (heat[id] != (uint32_t)-1)
+    heat[id]++;
+  if (slot[id] != TIER_NOSLOT)
+    memcpy(buf, ram + slot[id] * BLOCK_SIZE, BLOCK_SIZE);
+  else if (pread(fd, buf, BLOCK_SIZE, (off_t)id * BLOCK_SIZE) != BLOCK_SIZE)
+    printf("\tim: tier read of block %u failed\n", id);
+  pthread_mutex_unlock(&mx);
+}
+
+void
+tiered_disk::write_block(blockid_t id, const char *buf)
+{
+  if (id >= BLOCK_NUM || buf == NULL)
+    return;
+
+  pthread_mutex_lock(&mx);
+  if (heat[id] != (uint32_t)-1)
+    heat[id]++;
+  if (slot[id] != TIER_NOSLOT)
+    memcpy(ram + slot[id] * BLOCK_SIZE, buf, BLOCK_SIZE);
+  else if (pwrite(fd, buf, BLOCK_SIZE, (off_t)id * BLOCK_SIZE) != BLOCK_SIZE)
+    printf("\tim: tier write of block %u failed\n", id);
+  pthread_mutex_unlock(&mx);
+}
+
+// Blocks held in RAM are copied there and every stretch of the others
+// goes to the image in one write, so a sealed log segment that is not
+// promoted reaches the file tier as a single sequential write.
+void
+tiered_disk::write_blocks(blockid_t id, const char *buf, uint32_t n)
+{
+  uint32_t i, j;
+  ssize_t len;
+
+  if (id >= BLOCK_NUM || n > BLOCK_NUM - id || buf == NULL)
+    return;
+
+  pthread_mutex_lock(&mx);
+  for (i = 0; i < n; i = j) {
+    if (heat[id + i] != (uint32_t)-1)
+      heat[id + i]++;
+    if (slot[id + i] != TIER_NOSLOT) {
+      memcpy(ram + slot[id + i] * BLOCK_SIZE, buf + i * BLOCK_SIZE, BLOCK_SIZE);
+      j = i + 1;
+      continue;
+    }
+    for (j = i + 1; j < n && slot[id + j] == TIER_NOSLOT; ++j) {
+      if (heat[id + j] != (uint32_t)-1)
+        heat[id + j]++;
+    }
+    len = (ssize_t)(j - i) * BLOCK_SIZE;
+    if (pwrite(fd, buf + i * BLOCK_SIZE, len, (off_t)(id + i) * BLOCK_SIZE) != len)
+      printf("\tim: tier write of blocks %u-%u failed\n", id + i, id + j - 1);
+  }
+  pthread_mutex_unlock(&mx);
+}
+
+// Pin block id in RAM, promoting it now, or let it go back to being
+// migrated like any block. If no slot is free, the unpinned block in
+// the next slot round gives up its slot, whatever its heat: metadata
+// is always hotter than what block_manager does not pin.
+void
+tiered_disk::pin(blockid_t id, bool on)
+{
+  if (id >= BLOCK_NUM)
+    return;
+
+  pthread_mutex_lock(&mx);
+  if (!on || pinned[id]) {
+    pinned[id] = on;
+    pthread_mutex_unlock(&mx);
+    return;
+  }
+  if (slot[id] == TIER_NOSLOT && free_slots.empty()) {
+    for (uint32_t i = 0; i < nslots && free_slots.empty(); ++i) {
+      int s = hand;
+      hand = (hand + 1) % nslots;
+      if (!pinned[slot_owner[s]])
+        demote(s);
+    }
+  }
+  if (slot[id] == TIER_NOSLOT && !free_slots.empty())
+    promote(id);
+  pinned[id] = slot[id] != TIER_NOSLOT;
+  pthread_mutex_unlock(&mx);
+}
+
+// Move block id from the file tier into a free RAM slot. Called with mx held.
+void
+tiered_disk::promote(blockid_t id)
+{
+  int s = free_slots.back();
+  free_slots.pop_back();
+  if (pread(fd, ram + s * BLOCK_SIZE, BLOCK_SIZE, (off_t)id * BLOCK_SIZE) != BLOCK_SIZE)
+    memset(ram + s * BLOCK_SIZE, 0, BLOCK_SIZE);
+  slot[id] = s;
+  slot_owner[s] = id;
+}
+
+// Write RAM slot s back to the file tier and free it. Called with mx held.
+void
+tiered_disk::demote(int s)
+{
+  blockid_t id = slot_owner[s];
+  if (pwrite(fd, ram + s * BLOCK_SIZE, BLOCK_SIZE, (off_t)id * BLOCK_SIZE) != BLOCK_SIZE) {
+    printf("\tim: tier demote of block %u failed\n", id);
+    return;
+  }
+  slot[id] = TIER_NOSLOT;
+  free_slots.push_back(s);
+}
+
+// Background pass: promote the hottest file-tier blocks, demoting the
+// coldest unpinned RAM blocks whenever a hotter block wants their slot.
+void
+tiered_disk::migrate(int interval)
+{
+  std::vector<std::pair<uint32_t, blockid_t> > hot, cold;
+  uint32_t promoted, demoted, c;
+
+  while (true) {
+    sleep(interval);
+    pthread_mutex_lock(&mx);
+    hot.clear();
+    cold.clear();
+    for (blockid_t id = 0; id < BLOCK_NUM; ++id) {
+      if (pinned[id])
+        continue;
+      if (slot[id] == TIER_NOSLOT) {
+        if (heat[id] > 0)
+          hot.push_back(std::make_pair(heat[id], id));
+      } else {
+        cold.push_back(std::make_pair(heat[id], id));
+      }
+    }
+    std::sort(hot.rbegin(), hot.rend());
+    std::sort(cold.begin(), cold.end());
+
+    promoted = demoted = c = 0;
+    for (uint32_t i = 0; i < hot.size(); ++i) {
+      if (free_slots.empty()) {
+        if (c == cold.size() || cold[c].first >= hot[i].first)
+          break;
+        demote(slot[cold[c++].second]);
+        demoted++;
+      }
+      promote(hot[i].second);
+      promoted++;
+    }
+
+    for (blockid_t id = 0; id < BLOCK_NUM; ++id)
+      heat[id] >>= 1;
+    pthread_mutex_unlock(&mx);
+
+    if (promoted || demoted)
+      printf("\tim: tier migrate: %u promoted, %u demoted, %u RAM slots free\n",
+             promoted, demoted, (uint32_t)free_slots.size());
+  }
+}
+
 // block layer -----------------------------------------
 
 // Allocate a free disk block.
@@ -54,9 +282,10 @@ block_manager::alloc_block()
         if(!testn(bit_idx, (unsigned char&)block_buf[byte_idx])) {
           setn(bit_idx, (unsigned char&)block_buf[byte_idx]);
           // --End Critical Section
-          valid_blockid = (BYTE_SIZE - 1 - bit_idx) + (byte_idx * BYTE_SIZE) + ((iter - BBH) * BLOCK_SIZE);
+          valid_blockid = (BYTE_SIZE - 1 - bit_idx) + (byte_idx * BYTE_SIZE) + ((iter - BBH) * BPB);
           // Write bitmap back to disk
-          write_block(BBLOCK(valid_blockid), block_buf);
+          if (!write_block(BBLOCK(valid_blockid), block_buf))
+            return 0;
         }
       }
     }
@@ -68,6 +297,45 @@ block_manager::alloc_block()
   return valid_blockid;
 }
 
+// Allocate n contiguous free data blocks (first fit).
+// Return the first one, or 0 if there is no free run that long.
+blockid_t
+block_manager::alloc_run(uint32_t n)
+{
+  char block_buf[BLOCK_SIZE];
+  blockid_t id, bb = 0, first = 0;
+  uint32_t len = 0;
+
+  if (n == 0)
+    return 0;
+
+  for (id = DBH(sb.nblocks); id < sb.nblocks && len < n; ++id) {
+    if (BBLOCK(id) != bb) {
+      bb = BBLOCK(id);
+      read_block(bb, block_buf);
+    }
+    if (testn(BYTE_SIZE - 1 - (id%BPB)%BYTE_SIZE, (unsigned char&)block_buf[(id%BPB)/BYTE_SIZE])) {
+      len = 0;
+      continue;
+    }
+    if (len++ == 0)
+      first = id;
+  }
+  if (len < n)
+    return 0;
+
+  // mark the run, one bitmap block at a time
+  for (id = first; id < first + n; ) {
+    bb = BBLOCK(id);
+    read_block(bb, block_buf);
+    for (; id < first + n && BBLOCK(id) == bb; ++id)
+      setn(BYTE_SIZE - 1 - (id%BPB)%BYTE_SIZE, (unsigned char&)block_buf[(id%BPB)/BYTE_SIZE]);
+    if (!write_block(bb, block_buf))
+      return 0;
+  }
+  return first;
+}
+
 void
 block_manager::free_block(uint32_t id)
 {
@@ -93,9 +361,24 @@ block_manager::free_block(uint32_t id)
 
   unsetn(BYTE_SIZE - 1 - (id%BPB)%BYTE_SIZE, (unsigned char&)block_buf[(id%BPB)/BYTE_SIZE]);
   write_block(BBLOCK(id), block_buf);
+
+  if (log_mode) {
+    // the old copy in the log is garbage now
+    pthread_mutex_lock(&lmx);
+    log_kill(id);
+    pthread_mutex_unlock(&lmx);
+  }
   return;
 }
 
+void *
+log_cleaner_thread(void *m)
+{
+  block_manager *bm = (block_manager *)m;
+  bm->log_cleaner();
+  pthread_exit(NULL);
+}
+
 // The layout of disk should be like this:
 // |<-sb->|<-free block bitmap->|<-inode table->|<-data->|
 block_manager::block_manager()
@@ -105,7 +388,39 @@ block_manager::block_manager()
   unsigned int byte_idx, totbits=0, done=0;
   int bit_idx;
 
-  d = new disk();
+  char *tier_env = getenv("YFS_TIER_FILE");
+  if (tier_env != NULL) {
+    char *ram_env = getenv("YFS_TIER_RAM_BLOCKS");
+    d = new tiered_disk(tier_env, ram_env != NULL ? atoi(ram_env) : BLOCK_NUM/8);
+  } else {
+    d = new mem_disk();
+  }
+
+  log_mode = false;
+  seg_buf = NULL;
+  cleaning = false;
+  batching = false;
+  VERIFY(pthread_mutex_init(&lmx, NULL) == 0);
+  VERIFY(pthread_cond_init(&clean_cv, NULL) == 0);
+  char *log_env = getenv("YFS_LOG_MODE");
+  if (log_env != NULL && atoi(log_env) != 0) {
+    log_mode = true;
+    lmap.assign(BLOCK_NUM, LOG_NOBLOCK);
+    owner.assign(BLOCK_NUM, LOG_NOBLOCK);
+    seg_live.assign(NSEGS, 0);
+    seg_free.assign(NSEGS, true);
+    for (uint32_t s = 1; s < NSEGS; ++s)
+      free_segs.push_back(s);
+    cur_seg = 0;
+    cur_off = 0;
+    seg_free[0] = false;
+    seg_buf = (char *)malloc(SEG_BLOCKS * BLOCK_SIZE);
+    printf("\tim: log-structured mode, %d segments of %d blocks\n", NSEGS, SEG_BLOCKS);
+  } else {
+    // the superblock, bitmaps and inode table stay where they are
+    for (iter = 0; iter < DBH(BLOCK_NUM); ++iter)
+      d->pin(iter, true);
+  }
 
   // format the disk
   sb.size = BLOCK_SIZE * BLOCK_NUM;
@@ -130,25 +445,211 @@ block_manager::block_manager()
   for(iter = BBLOCK(0); iter <= BBLOCK(totbits - 1); ++iter) { 
     write_block(iter, block_buf);
   }
+
+  if (log_mode) {
+    pthread_t th;
+    VERIFY(pthread_create(&th, NULL, log_cleaner_thread, (void *)this) == 0);
+  }
 }
 
 void
 block_manager::read_block(uint32_t id, char *buf)
 {
-  d->read_block(id, buf);
+  if (batching && id < DBH(BLOCK_NUM)) {
+    std::map<blockid_t, std::string>::iterator it = meta_buf.find(id);
+    if (it != meta_buf.end()) {
+      memcpy(buf, it->second.data(), BLOCK_SIZE);
+      return;
+    }
+  }
+  if (!log_mode) {
+    d->read_block(id, buf);
+    return;
+  }
+  if (id >= BLOCK_NUM || buf == NULL)
+    return;
+
+  pthread_mutex_lock(&lmx);
+  blockid_t p = lmap[id];
+  if (p == LOG_NOBLOCK)
+    memset(buf, 0, BLOCK_SIZE); // never written, like a fresh disk
+  else if (p / SEG_BLOCKS == cur_seg)
+    memcpy(buf, seg_buf + (p % SEG_BLOCKS) * BLOCK_SIZE, BLOCK_SIZE);
+  else
+    d->read_block(p, buf);
+  pthread_mutex_unlock(&lmx);
 }
 
-void
+bool
 block_manager::write_block(uint32_t id, const char *buf)
 {
-  d->write_block(id, buf);
+  bool ok;
+
+  if (batching && id < DBH(BLOCK_NUM) && buf != NULL) {
+    meta_buf[id].assign(buf, BLOCK_SIZE);
+    return true;
+  }
+  if (!log_mode) {
+    d->write_block(id, buf);
+    return true;
+  }
+  if (id >= BLOCK_NUM || buf == NULL)
+    return true;
+
+  pthread_mutex_lock(&lmx);
+  ok = log_append(id, buf);
+  pthread_mutex_unlock(&lmx);
+  return ok;
+}
+
+void
+block_manager::begin_batch()
+{
+  batching = true;
+}
+
+bool
+block_manager::end_batch()
+{
+  std::map<blockid_t, std::string>::iterator it;
+  bool ok = true;
+
+  batching = false;
+  for (it = meta_buf.begin(); it != meta_buf.end(); ++it)
+    ok = write_block(it->first, it->second.data()) && ok;
+  meta_buf.clear();
+  return ok;
+}
+
+// log-structured mode --------------------------------
+// all log_* helpers are called with lmx held.
+
+// Forget the current location of logical block id.
+void
+block_manager::log_kill(blockid_t id)
+{
+  blockid_t p = lmap[id];
+  if (p == LOG_NOBLOCK)
+    return;
+  owner[p] = LOG_NOBLOCK;
+  seg_live[p / SEG_BLOCKS]--;
+  lmap[id] = LOG_NOBLOCK;
+  if (id < DBH(BLOCK_NUM))
+    d->pin(p, false);
+}
+
+// Seal the open segment with one sequential write and open a free one.
+bool
+block_manager::log_next_segment()
+{
+  d->write_blocks(cur_seg * SEG_BLOCKS, seg_buf, SEG_BLOCKS);
+  if (free_segs.empty())
+    return false;
+
+  cur_seg = free_segs.front();
+  free_segs.pop_front();
+  seg_free[cur_seg] = false;
+  cur_off = 0;
+  if (free_segs.size() < LOG_CLEAN_LOW)
+    pthread_cond_signal(&clean_cv);
+  return true;
+}
+
+// Returns false if the log has no room for the block.
+bool
+block_manager::log_append(blockid_t id, const char *buf)
+{
+  if (cur_off == SEG_BLOCKS) {
+    // A writer that would take one of the cleaner's LOG_RESERVE segments
+    // cleans right here first, and fails if that frees nothing. The
+    // cleaner itself appends through here, so don't recurse.
+    bool writer = !cleaning;
+    if (writer) {
+      cleaning = true;
+      while (free_segs.size() <= LOG_RESERVE && log_clean_one())
+        ;
+      cleaning = false;
+    }
+    if (cur_off == SEG_BLOCKS &&
+        ((writer && free_segs.size() <= LOG_RESERVE) || !log_next_segment())) {
+      printf("\tim: log is full, write of block %u failed\n", id);
+      return false;
+    }
+  }
+
+  blockid_t p = cur_seg * SEG_BLOCKS + cur_off++;
+  memcpy(seg_buf + (p % SEG_BLOCKS) * BLOCK_SIZE, buf, BLOCK_SIZE);
+  log_kill(id);
+  lmap[id] = p;
+  owner[p] = id;
+  seg_live[cur_seg]++;
+  // metadata moves with every write; tell the disk where it is now
+  if (id < DBH(BLOCK_NUM))
+    d->pin(p, true);
+  return true;
+}
+
+// Greedy cleaning: copy the live blocks of the emptiest sealed segment
+// to the head of the log and free it. Returns false if no segment has
+// any garbage left.
+bool
+block_manager::log_clean_one()
+{
+  uint32_t victim = NSEGS;
+  for (uint32_t s = 0; s < NSEGS; ++s) {
+    if (s == cur_seg || seg_free[s] || seg_live[s] == SEG_BLOCKS)
+      continue;
+    if (victim == NSEGS || seg_live[s] < seg_live[victim])
+      victim = s;
+  }
+  if (victim == NSEGS)
+    return false;
+
+  std::vector<blockid_t> ids;
+  std::string live;
+  char buf[BLOCK_SIZE];
+  for (blockid_t p = victim * SEG_BLOCKS; p < (victim + 1) * SEG_BLOCKS; ++p) {
+    if (owner[p] == LOG_NOBLOCK)
+      continue;
+    d->read_block(p, buf);
+    ids.push_back(owner[p]);
+    live.append(buf, BLOCK_SIZE);
+    log_kill(owner[p]);
+  }
+  seg_free[victim] = true;
+  free_segs.push_back(victim);
+
+  for (uint32_t i = 0; i < ids.size(); ++i)
+    log_append(ids[i], live.data() + i * BLOCK_SIZE);
+  return true;
+}
+
+void
+block_manager::log_cleaner()
+{
+  pthread_mutex_lock(&lmx);
+  while (true) {
+    VERIFY(pthread_cond_wait(&clean_cv, &lmx) == 0);
+    while (free_segs.size() < LOG_CLEAN_HIGH) {
+      cleaning = true;
+      bool more = log_clean_one();
+      cleaning = false;
+      if (!more)
+        break;
+      // let writers in between segments
+      pthread_mutex_unlock(&lmx);
+      pthread_mutex_lock(&lmx);
+    }
+  }
 }
 
 // inode layer -----------------------------------------
 
-inode_manager::inode_manager()
+inode_manager::inode_manager(bool root)
 {
   bm = new block_manager();
+  if (!root)
+    return;
   uint32_t root_dir = alloc_inode(extent_protocol::T_DIR);
   if (root_dir != 1) {
     printf("\tim: error! alloc first inode %d, should be 1\n", root_dir);
@@ -195,6 +696,9 @@ inode_manager::alloc_inode(uint32_t type)
     ino_disk = (struct inode*)buf + inum%IPB;
     // Find an empty entry in inode table 
     if (ino_disk->type == 0) {
+      // carry on from the slot's last life, so a (inum, version) pair
+      // cached by a client never names two different contents
+      ino->version = ino_disk->version + 1;
       break;
     }
   }
@@ -208,7 +712,8 @@ inode_manager::alloc_inode(uint32_t type)
   switch (type) {
     case extent_protocol::T_DIR:
     case extent_protocol::T_FILE:
-      put_inode(inum, ino);
+      if (!put_inode(inum, ino))
+        inum = 0;
       break;
     default:
       // Unknown type, ignore alloc request
@@ -278,7 +783,7 @@ inode_manager::get_inode(uint32_t inum)
   return ino;
 }
 
-void
+bool
 inode_manager::put_inode(uint32_t inum, struct inode *ino)
 {
   char buf[BLOCK_SIZE];
@@ -286,32 +791,27 @@ inode_manager::put_inode(uint32_t inum, struct inode *ino)
 
   //printf("\tim: put_inode %d\n", inum);
   if (ino == NULL)
-    return;
+    return false;
 
   bm->read_block(IBLOCK(inum, bm->sb.nblocks), buf);
   ino_disk = (struct inode*)buf + inum%IPB;
   *ino_disk = *ino;
-  bm->write_block(IBLOCK(inum, bm->sb.nblocks), buf);
+  return bm->write_block(IBLOCK(inum, bm->sb.nblocks), buf);
 }
 
 #define MIN(a,b) ((a)<(b) ? (a) : (b))
+#define MAX(a,b) ((a)>(b) ? (a) : (b))
 
-/* Get all the data of a file by inum. 
- * Return alloced data, should be freed by caller. */
+/* Get all the data of a file by inum into buf. Blocks are read
+ * straight into the string, the tail of the last block is cut off
+ * afterwards, so the data is copied once on its way out of the disk. */
 void
-inode_manager::read_file(uint32_t inum, char **buf_out, int *size)
+inode_manager::read_file(uint32_t inum, std::string &buf)
 {
-  /*
-   * your lab1 code goes here.
-   * note: read blocks related to inode number inum,
-   * and copy them to buf_Out
-   */
   inode *ino;
-  char block_buf[BLOCK_SIZE], indblock_buf[BLOCK_SIZE];
-  blockid_t blockn; // Block numbers
-  time_t tm;
-
+  std::vector<blockid_t> blocks;
 
+  buf.clear();
   ino = get_inode(inum);
 
   if (ino == NULL) {
@@ -319,54 +819,23 @@ inode_manager::read_file(uint32_t inum, char **buf_out, int *size)
     return;
   }
 
-  *size = ino->size;
-  *buf_out = (char *)malloc(ino->size);
-  memset(*buf_out, 0, *size);
-  blockn = ((*size) + BLOCK_SIZE - 1) / BLOCK_SIZE;
-  if (!blockn) {
-    tm = time(NULL);
-    ino->atime = (uint32_t)tm;
-    put_inode(inum, ino);
-    free(ino);
-    return;
-  }
-
-  // indirect blocks not used
-  if (blockn <= NDIRECT){
-    for (blockid_t i = 0; i < blockn - 1; ++i) {
-      bm->read_block(ino->blocks[i], &(*buf_out)[i*BLOCK_SIZE]);
-    }
-    
-    memset(block_buf, 0, BLOCK_SIZE);
-    bm->read_block(ino->blocks[blockn - 1], block_buf);
-    memcpy(&(*buf_out)[(blockn - 1)*BLOCK_SIZE], block_buf, (*size) - (blockn - 1)*BLOCK_SIZE);
-  }
-  else { // indirect blocks used
-    for (blockid_t i = 0; i < NDIRECT; ++i) {
-      bm->read_block(ino->blocks[i], &(*buf_out)[i*BLOCK_SIZE]);
-    }
-    bm->read_block(ino->blocks[NDIRECT], indblock_buf);
-    
-    // indirect blocks (if exist)
-    for (blockid_t i = 0; i < blockn-NDIRECT - 1; ++i) {
-      bm->read_block(*(blockid_t*)&indblock_buf[i*sizeof(blockid_t)], &(*buf_out)[(i + NDIRECT)*BLOCK_SIZE]);
-    }
-
-    bm->read_block(*(blockid_t*)&indblock_buf[(blockn - NDIRECT - 1)*sizeof(blockid_t)], block_buf);
-    memcpy(&(*buf_out)[(blockn - 1)*BLOCK_SIZE], block_buf, (*size) - (blockn - 1)*BLOCK_SIZE);  
+  if (ino->size > 0) {
+    load_map(ino, blocks);
+    buf.resize(blocks.size() * BLOCK_SIZE);
+    for (blockid_t i = 0; i < blocks.size(); ++i)
+      bm->read_block(blocks[i], &buf[i * BLOCK_SIZE]);
+    buf.resize(ino->size);
   }
 
   // Update attrs of inode
-  tm = time(NULL);
-  ino->atime = (uint32_t)tm;
+  ino->atime = (uint32_t)time(NULL);
   put_inode(inum, ino);
   free(ino);
-   
-  return;
 }
 
-/* alloc/free blocks if needed */
-void
+/* alloc/free blocks if needed.
+ * Return false if the file would be too big or the disk is full. */
+bool
 inode_manager::write_file(uint32_t inum, const char *buf, int size)
 {
   /*
@@ -376,119 +845,303 @@ inode_manager::write_file(uint32_t inum, const char *buf, int size)
    * is larger or smaller than the size of original inode
    */
   struct inode *ino;
-  blockid_t bold, bnew, indbold, indbnew, dbold, dbnew; // b = block number; ind = indirect; d = direct
-  char block_buf[BLOCK_SIZE], indblock_buf[BLOCK_SIZE];
+  std::vector<blockid_t> blocks;
+  char block_buf[BLOCK_SIZE];
+  uint32_t bnew, oldn;
   time_t tm;
+  bool ok = true;
 
   ino = get_inode(inum);
   if (!ino){
     // printf("\tim: cannot get inode!\n");
-    return;
+    return false;
   }
-  bold = ((ino->size) + BLOCK_SIZE - 1) / BLOCK_SIZE;
   bnew = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
 
-  if (bnew > MAXFILE){
+  load_map(ino, blocks);
+  oldn = blocks.size();
+  if (!resize_map(ino, blocks, bnew)) {
     //printf("\tim: cannot support big file!\n");
     free(ino);   
-    return;
+    return false;
   }
 
-  if (bold > NDIRECT) {
-    indbold = (bold - NDIRECT);
-    dbold = NDIRECT;
-  }
-  else {
-    indbold = 0;
-    dbold = bold;
+  for (uint32_t i = 0; i + 1 < bnew; ++i) {
+    ok = bm->write_block(blocks[i], &buf[i*BLOCK_SIZE]) && ok;
   }
-  if (bnew > NDIRECT) {
-    indbnew = (bnew - NDIRECT);
-    dbnew = NDIRECT;
-  }
-  else {
-    indbnew = 0;
-    dbnew = bnew;
+  // keep the bytes past EOF in the last block zeroed
+  if (bnew > 0) {
+    memset(block_buf, 0, BLOCK_SIZE);
+    memcpy(block_buf, &buf[(bnew - 1)*BLOCK_SIZE], size - (bnew - 1)*BLOCK_SIZE);
+    ok = bm->write_block(blocks[bnew - 1], block_buf) && ok;
   }
-  
-  // free blocks
-  if (bnew < bold) {
-    if (indbold > 0) {
-      bm->read_block(ino->blocks[NDIRECT], block_buf);
-      for (blockid_t i = indbnew; i < indbold; i++) {
-        bm->free_block(*((blockid_t*)&block_buf[i*sizeof(block_buf)]));
-      }
-      // bnew don't need indirect list block, free it
-      if (!indbnew) {
-        bm->free_block(ino->blocks[NDIRECT]);
-        // set to 0 not necessary?
-        ino->blocks[NDIRECT] = 0;
-      }
-    }
+  ok = store_map(ino, blocks, oldn) && ok;
 
-    for (blockid_t i = dbnew; i < dbold;i++) {
-      bm->free_block(ino->blocks[i]);
-      ino->blocks[NDIRECT]=0;
-    }
+  tm = time(NULL);
+  ino->size = size;
+  // change here (lab5)
+  if (ino->type == extent_protocol::T_DIR)
+    ino->ctime = (uint32_t)tm;
+  //ino->ctime = (uint32_t)tm;
+  ino->mtime = (uint32_t)tm;
+  ino->version++;
+  ok = put_inode(inum, ino) && ok;
+  free(ino);   
+  return ok;
+}
 
+/* Read at most len bytes of inum starting at off into buf. Only an
+ * unaligned head goes through a bounce block; whole blocks are read
+ * in place. */
+void
+inode_manager::read_range(uint32_t inum, uint32_t off, uint32_t len,
+                          std::string &buf)
+{
+  inode *ino;
+  std::vector<blockid_t> blocks;
+  char block_buf[BLOCK_SIZE];
+  uint32_t first, last, head, i;
+
+  buf.clear();
+  ino = get_inode(inum);
+  if (ino == NULL) {
+    printf("\tim: cannot read inum!\n");
+    return;
   }
-  else if (bnew > bold) {
-    for (blockid_t i = dbold; i < dbnew; ++i) {
-      ino->blocks[i] = bm->alloc_block();
-    }
 
-    if (indbnew > 0) {
-      // bnew need a new indirect list block, alloc one
-      if (!indbold) {
-        ino->blocks[NDIRECT] = bm->alloc_block();
-      }
-      bm->read_block(ino->blocks[NDIRECT], block_buf);
-      for (blockid_t i = indbold; i < indbnew; ++i) {
-        *((blockid_t*)&block_buf[i*sizeof(blockid_t)]) = bm->alloc_block();
-      } 
-      bm->write_block(ino->blocks[NDIRECT], block_buf);
+  if (off < ino->size) {
+    len = MIN(len, ino->size - off);
+    load_map(ino, blocks);
+    first = off / BLOCK_SIZE;
+    last = (off + len + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    head = 0;
+    if (off % BLOCK_SIZE) {
+      head = MIN(BLOCK_SIZE - off % BLOCK_SIZE, len);
+      first++;
     }
+    // room for the head plus whole blocks, trimmed to len below
+    buf.resize(head + (last - first) * BLOCK_SIZE);
+    if (head) {
+      bm->read_block(blocks[first - 1], block_buf);
+      memcpy(&buf[0], block_buf + off % BLOCK_SIZE, head);
+    }
+    for (i = first; i < last; ++i)
+      bm->read_block(blocks[i], &buf[head + (i - first) * BLOCK_SIZE]);
+    buf.resize(len);
   }
-  
-  // Quick path here if write nothing here, just update attrs
-  if (size == 0) {
-    tm = time(NULL);
-    ino->size = size;
-    if (ino->type == extent_protocol::T_DIR)
-      ino->ctime = (uint32_t)tm;
-    ino->mtime = (uint32_t)tm;
-    put_inode(inum, ino);
-    free(ino);   
-    return;
+
+  ino->atime = (uint32_t)time(NULL);
+  put_inode(inum, ino);
+  free(ino);
+}
+
+/* Write size bytes at off, growing the file (with '\0's in any
+ * hole) if needed. Only the blocks covering [off, off+size) are
+ * touched, plus the blocks of a hole. */
+bool
+inode_manager::write_range(uint32_t inum, uint32_t off, const char *buf, int size)
+{
+  inode *ino;
+  std::vector<blockid_t> blocks;
+  char block_buf[BLOCK_SIZE];
+  uint32_t oldn, end, newsize, pos, n, i;
+  time_t tm;
+  bool ok = true;
+
+  // off + size must not wrap around
+  if (size < 0 || (uint64_t)off + size > MAXFILE * BLOCK_SIZE)
+    return false;
+  ino = get_inode(inum);
+  if (ino == NULL)
+    return false;
+
+  end = off + size;
+  newsize = MAX(ino->size, end);
+  load_map(ino, blocks);
+  oldn = blocks.size();
+  if (!resize_map(ino, blocks, (newsize + BLOCK_SIZE - 1) / BLOCK_SIZE)) {
+    free(ino);
+    return false;
   }
 
-  for (blockid_t i = 0; i < MIN(dbnew, bnew-1); ++i) {
-    bm->write_block(ino->blocks[i], &buf[i*BLOCK_SIZE]);
-  } 
-  if (indbnew > 0) {
-    bm->read_block(ino->blocks[NDIRECT], block_buf);
-    for (blockid_t i = 0; i < indbnew - 1; ++i) {
-      bm->write_block(*((blockid_t*)&block_buf[i*sizeof(blockid_t)]), &buf[(i+NDIRECT)*BLOCK_SIZE]);
+  // fresh blocks in front of the written range are part of a hole
+  memset(block_buf, 0, BLOCK_SIZE);
+  for (i = oldn; i < off / BLOCK_SIZE; ++i)
+    ok = bm->write_block(blocks[i], block_buf) && ok;
+
+  for (pos = off; pos < end; pos += n) {
+    i = pos / BLOCK_SIZE;
+    n = MIN(BLOCK_SIZE - pos % BLOCK_SIZE, end - pos);
+    if (n == BLOCK_SIZE) {
+      ok = bm->write_block(blocks[i], &buf[pos - off]) && ok;
+      continue;
     }
+    // bytes past EOF of an existing block are already zero
+    if (i < oldn)
+      bm->read_block(blocks[i], block_buf);
+    else
+      memset(block_buf, 0, BLOCK_SIZE);
+    memcpy(block_buf + pos % BLOCK_SIZE, &buf[pos - off], n);
+    ok = bm->write_block(blocks[i], block_buf) && ok;
   }
+  ok = store_map(ino, blocks, oldn) && ok;
 
-  memset(indblock_buf, 0, BLOCK_SIZE);
-  memcpy(indblock_buf, &buf[(bnew - 1)*BLOCK_SIZE], size - (bnew - 1)*BLOCK_SIZE);
-  if (bnew <= NDIRECT)
-    bm->write_block(ino->blocks[bnew-1], indblock_buf);
-  else
-    bm->write_block(*(blockid_t*)&block_buf[(bnew - NDIRECT - 1)*sizeof(blockid_t)], indblock_buf);
+  tm = time(NULL);
+  ino->size = newsize;
+  if (ino->type == extent_protocol::T_DIR)
+    ino->ctime = (uint32_t)tm;
+  ino->mtime = (uint32_t)tm;
+  ino->version++;
+  ok = put_inode(inum, ino) && ok;
+  free(ino);
+  return ok;
+}
+
+/* Write size bytes at the end of inum and set off to where they went.
+ * Like write_range, only the last block and the new ones are touched.
+ * Return false, writing nothing, if the file would grow too big, or
+ * if the disk is full. */
+bool
+inode_manager::append_file(uint32_t inum, const char *buf, int size, uint32_t &off)
+{
+  inode *ino;
+
+  ino = get_inode(inum);
+  if (ino == NULL)
+    return false;
+  off = ino->size;
+  free(ino);
+
+  if (off + size > MAXFILE * BLOCK_SIZE)
+    return false;
+  return write_range(inum, off, buf, size);
+}
+
+/* Set the size of inum, freeing or zero-filling blocks as needed. */
+bool
+inode_manager::truncate_file(uint32_t inum, uint32_t size)
+{
+  inode *ino;
+  std::vector<blockid_t> blocks;
+  char block_buf[BLOCK_SIZE];
+  uint32_t oldn, bnew, i;
+  time_t tm;
+  bool ok = true;
+
+  ino = get_inode(inum);
+  if (ino == NULL)
+    return false;
+
+  bnew = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  load_map(ino, blocks);
+  oldn = blocks.size();
+  if (!resize_map(ino, blocks, bnew)) {
+    free(ino);
+    return false;
+  }
+
+  if (size < ino->size && size % BLOCK_SIZE != 0) {
+    // cut the new last block so that growing the file later reads zeros
+    bm->read_block(blocks[bnew - 1], block_buf);
+    memset(block_buf + size % BLOCK_SIZE, 0, BLOCK_SIZE - size % BLOCK_SIZE);
+    ok = bm->write_block(blocks[bnew - 1], block_buf) && ok;
+  }
+  memset(block_buf, 0, BLOCK_SIZE);
+  for (i = oldn; i < bnew; ++i)
+    ok = bm->write_block(blocks[i], block_buf) && ok;
+  ok = store_map(ino, blocks, oldn) && ok;
 
   tm = time(NULL);
   ino->size = size;
-  // change here (lab5)
   if (ino->type == extent_protocol::T_DIR)
     ino->ctime = (uint32_t)tm;
-  //ino->ctime = (uint32_t)tm;
   ino->mtime = (uint32_t)tm;
-  put_inode(inum, ino);
-  free(ino);   
-  return;
+  ino->version++;
+  ok = put_inode(inum, ino) && ok;
+  free(ino);
+  return ok;
+}
+
+// Read the data block numbers of ino, in file order.
+void
+inode_manager::load_map(struct inode *ino, std::vector<blockid_t> &blocks)
+{
+  char indbuf[BLOCK_SIZE];
+  uint32_t bnum, i;
+
+  blocks.clear();
+  bnum = (ino->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  for (i = 0; i < bnum && i < NDIRECT; ++i)
+    blocks.push_back(ino->blocks[i]);
+  if (bnum > NDIRECT) {
+    bm->read_block(ino->blocks[NDIRECT], indbuf);
+    for (i = NDIRECT; i < bnum; ++i)
+      blocks.push_back(((blockid_t*)indbuf)[i - NDIRECT]);
+  }
+}
+
+// Allocate or free data blocks so that blocks holds n entries, and
+// allocate ino's indirect block if the map grows past NDIRECT.
+// Return false, leaving blocks and ino as they were, if n is too big
+// for one inode or the disk is full.
+bool
+inode_manager::resize_map(struct inode *ino, std::vector<blockid_t> &blocks,
+                          uint32_t n)
+{
+  uint32_t oldn = blocks.size();
+  blockid_t b = 0;
+
+  if (n > MAXFILE)
+    return false;
+  while (blocks.size() > n) {
+    bm->free_block(blocks.back());
+    blocks.pop_back();
+  }
+  while (blocks.size() < n) {
+    b = bm->alloc_block();
+    if (b == 0)
+      break;
+    blocks.push_back(b);
+  }
+  if (b != 0 && oldn <= NDIRECT && n > NDIRECT) {
+    b = bm->alloc_block();
+    if (b != 0)
+      ino->blocks[NDIRECT] = b;
+  }
+  if (n > oldn && b == 0) {
+    while (blocks.size() > oldn) {
+      bm->free_block(blocks.back());
+      blocks.pop_back();
+    }
+    return false;
+  }
+  return true;
+}
+
+// Write blocks back into ino (the caller puts the inode) and into its
+// indirect block, which resize_map allocated and which is freed here if
+// the map shrinks below NDIRECT. oldn is the number of blocks ino had
+// before. Return false if the indirect block could not be written.
+bool
+inode_manager::store_map(struct inode *ino, const std::vector<blockid_t> &blocks,
+                         uint32_t oldn)
+{
+  char indbuf[BLOCK_SIZE];
+  uint32_t i;
+
+  for (i = 0; i < blocks.size() && i < NDIRECT; ++i)
+    ino->blocks[i] = blocks[i];
+
+  if (blocks.size() > NDIRECT) {
+    memset(indbuf, 0, BLOCK_SIZE);
+    for (i = NDIRECT; i < blocks.size(); ++i)
+      ((blockid_t*)indbuf)[i - NDIRECT] = blocks[i];
+    return bm->write_block(ino->blocks[NDIRECT], indbuf);
+  } else if (oldn > NDIRECT) {
+    bm->free_block(ino->blocks[NDIRECT]);
+    ino->blocks[NDIRECT] = 0;
+  }
+  return true;
 }
 
 void
@@ -512,6 +1165,7 @@ inode_manager::getattr(uint32_t inum, extent_protocol::attr &a)
   a.atime = (uint32_t)ino->atime;  
   a.mtime = (uint32_t)ino->mtime;  
   a.ctime = (uint32_t)ino->ctime;
+  a.version = ino->version;
 
   free(ino);
   return;
@@ -526,9 +1180,7 @@ inode_manager::remove_file(uint32_t inum)
    */
 
   inode *ino;
-  int bnum, i;
-  blockid_t *indblocks;
-  char buf_indblocks[BLOCK_SIZE];
+  std::vector<blockid_t> blocks;
 
   ino = get_inode(inum);
   if (ino == NULL) {
@@ -536,24 +1188,95 @@ inode_manager::remove_file(uint32_t inum)
     return;
   }
 
-  bnum = (ino->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
-
+  load_map(ino, blocks);
+  for (uint32_t i = 0; i < blocks.size(); ++i) {
+    bm->free_block(blocks[i]);
+  }
   // Free indirect block
-  if (bnum > NDIRECT) {
-    bm->read_block(ino->blocks[NDIRECT], buf_indblocks);
-    indblocks = (blockid_t*)buf_indblocks;
-    for (i = 0; i < (bnum - NDIRECT); ++i) {
-      bm->free_block(indblocks[i]);
-    }
+  if (blocks.size() > NDIRECT) {
     bm->free_block(ino->blocks[NDIRECT]);
   }
 
-  for (i = 0; i < bnum; ++i) {
-    bm->free_block(ino->blocks[i]);
-  }
-
   free_inode(inum);
   free(ino);
   return;
 }
 
+
+uint32_t
+count_runs(const std::vector<blockid_t> &blocks)
+{
+  uint32_t runs = blocks.empty() ? 0 : 1;
+  for (uint32_t i = 1; i < blocks.size(); ++i) {
+    if (blocks[i] != blocks[i-1] + 1)
+      runs++;
+  }
+  return runs;
+}
+
+/* Fill blocks with the data block numbers of inum, in file order.
+ * Return false (quietly) if inum is not in use. */
+bool
+inode_manager::block_map(uint32_t inum, std::vector<blockid_t> &blocks)
+{
+  char buf[BLOCK_SIZE];
+  struct inode *ino;
+
+  if (inum <= 0 || inum >= INODE_NUM)
+    return false;
+
+  bm->read_block(IBLOCK(inum, bm->sb.nblocks), buf);
+  ino = (struct inode*)buf + inum%IPB;
+  if (ino->type == 0)
+    return false;
+
+  load_map(ino, blocks);
+  return true;
+}
+
+/* Move the data of a fragmented file into one contiguous run.
+ * The indirect block itself stays where it is.
+ * Return true if the file was moved. */
+bool
+inode_manager::relocate_file(uint32_t inum)
+{
+  std::vector<blockid_t> blocks;
+  char buf[BLOCK_SIZE], indbuf[BLOCK_SIZE];
+  inode *ino;
+  blockid_t first;
+  uint32_t i;
+
+  if (!block_map(inum, blocks) || count_runs(blocks) <= 1)
+    return false;
+
+  first = bm->alloc_run(blocks.size());
+  if (first == 0)
+    return false;
+
+  for (i = 0; i < blocks.size(); ++i) {
+    bm->read_block(blocks[i], buf);
+    if (!bm->write_block(first + i, buf)) {
+      for (i = 0; i < blocks.size(); ++i)
+        bm->free_block(first + i);
+      return false;
+    }
+  }
+
+  ino = get_inode(inum);
+  if (ino == NULL)
+    return false;
+  for (i = 0; i < blocks.size() && i < NDIRECT; ++i)
+    ino->blocks[i] = first + i;
+  if (blocks.size() > NDIRECT) {
+    bm->read_block(ino->blocks[NDIRECT], indbuf);
+    for (i = NDIRECT; i < blocks.size(); ++i)
+      ((blockid_t*)indbuf)[i - NDIRECT] = first + i;
+    bm->write_block(ino->blocks[NDIRECT], indbuf);
+  }
+  put_inode(inum, ino);
+  free(ino);
+
+  for (i = 0; i < blocks.size(); ++i)
+    bm->free_block(blocks[i]);
+  return true;
+}
@@ -4,6 +4,9 @@
 #define inode_h
 
 #include <stdint.h>
+#include <pthread.h>
+#include <vector>
+#include <deque>
 #include "extent_protocol.h" // TODO: delete it
 
 #define DISK_SIZE  1024*1024*16
@@ -15,13 +18,61 @@ typedef uint32_t blockid_t;
 // disk layer -----------------------------------------
 
 class disk {
+ public:
+  virtual ~disk() {}
+  virtual void read_block(uint32_t id, char *buf) = 0;
+  virtual void write_block(uint32_t id, const char *buf) = 0;
+  // write n contiguous blocks starting at id
+  virtual void write_blocks(uint32_t id, const char *buf, uint32_t n);
+  // block_manager's hint that block id holds (on) or no longer holds
+  // metadata, which a disk with a fast tier should keep there
+  virtual void pin(uint32_t id, bool on) {}
+};
+
+// the default disk, all in memory
+class mem_disk : public disk {
  private:
   unsigned char blocks[BLOCK_NUM][BLOCK_SIZE];
 
  public:
-  disk();
+  mem_disk();
   void read_block(uint32_t id, char *buf);
   void write_block(uint32_t id, const char *buf);
+  void write_blocks(uint32_t id, const char *buf, uint32_t n);
+};
+
+// Two-tier disk (set YFS_TIER_FILE=<image path> in extent_server's
+// environment). A RAM tier of YFS_TIER_RAM_BLOCKS slots holds hot blocks
+// and the image file holds the rest; each block lives in exactly one tier.
+// Access counts, halved on every pass of the background migrator, decide
+// which file-tier blocks get promoted and which RAM blocks get demoted.
+// Blocks block_manager pins, the ones holding the superblock, bitmaps
+// and inode table wherever they are, stay in RAM.
+#define TIER_NOSLOT  (-1)
+
+class tiered_disk : public disk {
+ private:
+  int fd;
+  char *ram;
+  uint32_t nslots;
+  std::vector<bool> pinned;         // block -> never leaves RAM
+  uint32_t hand;                    // next RAM slot pin() may demote
+  std::vector<int> slot;            // block -> RAM slot, TIER_NOSLOT if in file
+  std::vector<blockid_t> slot_owner; // RAM slot -> block
+  std::vector<int> free_slots;
+  std::vector<uint32_t> heat;       // decayed access count per block
+  pthread_mutex_t mx;
+
+  void promote(blockid_t id);
+  void demote(int s);
+
+ public:
+  tiered_disk(const char *path, uint32_t ram_blocks);
+  void read_block(uint32_t id, char *buf);
+  void write_block(uint32_t id, const char *buf);
+  void write_blocks(uint32_t id, const char *buf, uint32_t n);
+  void pin(uint32_t id, bool on);
+  void migrate(int interval);
 };
 
 // block layer -----------------------------------------
@@ -32,19 +83,66 @@ typedef struct superblock {
   uint32_t ninodes;
 } superblock_t;
 
+// Log-structured mode (set YFS_LOG_MODE=1 in extent_server's environment).
+// The whole disk becomes a log of SEG_BLOCKS-sized segments. Every write of
+// a logical block (data, indirect, inode table, bitmap) is appended to the
+// open segment and lmap remembers where the latest copy lives; lmap plays
+// the role of LFS's inode map, at block granularity so inode_manager stays
+// unaware of it. A background cleaner compacts the emptiest segments.
+#define SEG_BLOCKS     64
+#define NSEGS          (BLOCK_NUM/SEG_BLOCKS)
+#define LOG_NOBLOCK    ((blockid_t)-1)
+// cleaner wakes up below LOG_CLEAN_LOW free segments and stops at LOG_CLEAN_HIGH
+#define LOG_CLEAN_LOW  (NSEGS/8)
+#define LOG_CLEAN_HIGH (NSEGS/4)
+// free segments only the cleaner may take: cleaning one segment needs at
+// most one more, so it can always make room. Writes that would dig into
+// them fail instead.
+#define LOG_RESERVE    2
+
 class block_manager {
  private:
   disk *d;
   // using_blocks is not in use
   std::map <uint32_t, int> using_blocks;
+
+  // log-structured mode state, protected by lmx
+  bool log_mode;
+  pthread_mutex_t lmx;
+  pthread_cond_t clean_cv;
+  std::vector<blockid_t> lmap;      // logical -> physical block
+  std::vector<blockid_t> owner;     // physical -> logical (segment summary)
+  std::vector<uint32_t> seg_live;   // live blocks per segment
+  std::deque<uint32_t> free_segs;
+  std::vector<bool> seg_free;
+  uint32_t cur_seg, cur_off;
+  char *seg_buf;                    // open segment, appended in one write
+  bool cleaning;
+
+  // bitmap and inode table blocks written during a batch are kept here
+  // and written out once by end_batch()
+  bool batching;
+  std::map<blockid_t, std::string> meta_buf;
+
+  bool log_append(blockid_t id, const char *buf);
+  void log_kill(blockid_t id);
+  bool log_next_segment();
+  bool log_clean_one();
+
  public:
   block_manager();
   struct superblock sb;
 
+  void log_cleaner();
+
   uint32_t alloc_block();
+  uint32_t alloc_run(uint32_t n);
   void free_block(uint32_t id);
   void read_block(uint32_t id, char *buf);
-  void write_block(uint32_t id, const char *buf);
+  // false if the log has no room left for the block
+  bool write_block(uint32_t id, const char *buf);
+  void begin_batch();
+  bool end_batch();
 };
 
 // inode layer -----------------------------------------
@@ -72,7 +170,7 @@ class block_manager {
 
 // Bitmap Block Head/Tail
 #define BBH  2
-#define BBT  (BBH + (BLOCK_NUM+BPB-1/BPB))
+#define BBT  (BBH + (BLOCK_NUM+BPB-1)/BPB)
 
 // Block containing bit for block b
 #define BBLOCK(b) ((b)/BPB + BBH)
@@ -87,6 +185,7 @@ typedef struct inode {
   unsigned int atime;
   unsigned int mtime;
   unsigned int ctime;
+  unsigned int version;          // bumped on every change to the data
   blockid_t blocks[NDIRECT+1];   // Data block addresses
 } inode_t;
 
@@ -94,17 +193,36 @@ class inode_manager {
  private:
   block_manager *bm;
   struct inode* get_inode(uint32_t inum);
-  void put_inode(uint32_t inum, struct inode *ino);
+  bool put_inode(uint32_t inum, struct inode *ino);
+  void load_map(struct inode *ino, std::vector<blockid_t> &blocks);
+  bool resize_map(struct inode *ino, std::vector<blockid_t> &blocks, uint32_t n);
+  bool store_map(struct inode *ino, const std::vector<blockid_t> &blocks, uint32_t oldn);
 
  public:
-  inode_manager();
+  // only the inode_manager of extent_server shard 0 makes inode 1 the
+  // root directory; on the others it is handed out like any inode
+  inode_manager(bool root = true);
   uint32_t alloc_inode(uint32_t type);
   void free_inode(uint32_t inum);
-  void read_file(uint32_t inum, char **buf, int *size);
-  void write_file(uint32_t inum, const char *buf, int size);
+  void read_file(uint32_t inum, std::string &buf);
+  // the writers return false if inum is not in use, the file would grow
+  // too big or the disk is full
+  bool write_file(uint32_t inum, const char *buf, int size);
+  void read_range(uint32_t inum, uint32_t off, uint32_t len, std::string &buf);
+  bool write_range(uint32_t inum, uint32_t off, const char *buf, int size);
+  bool append_file(uint32_t inum, const char *buf, int size, uint32_t &off);
+  bool truncate_file(uint32_t inum, uint32_t size);
   void remove_file(uint32_t inum);
   void getattr(uint32_t inum, extent_protocol::attr &a);
+  bool block_map(uint32_t inum, std::vector<blockid_t> &blocks);
+  bool relocate_file(uint32_t inum);
+  // group several operations' metadata updates into one write each
+  void begin_batch() { bm->begin_batch(); }
+  bool end_batch() { return bm->end_batch(); }
 };
 
+// number of contiguous runs in a block map
+uint32_t count_runs(const std::vector<blockid_t> &blocks);
+
 #endif
 
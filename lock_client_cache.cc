@@ -12,22 +12,28 @@
 int lock_client_cache::last_port = 0;
 
 void lock_client_cache::release_lock() {
+  std::vector<lock_protocol::lockid_t> lids;
   while(true)
   {
-    lock_protocol::lockid_t lid = lhandler.outque();
-    dprintf("lock_client_cache: release lock: got lock(%llu) sending release RPC to server\n", lid);
-    int tmp;
+    // the locks revoked while the last group was going back are
+    // written back together, so a burst drains in a few round trips
+    lhandler.outque(lids);
+    dprintf("lock_client_cache: release lock: got %u locks, sending release RPCs to server\n", lids.size());
     if (lu != NULL)
-      lu->dorelease(lid);
-    lock_protocol::status ret = cl->call(lock_protocol::release, lid, id, tmp);
-    if (ret != lock_protocol::OK) {
-      dprintf("lock_client_cache: lhandler thread: release RPC failed on lock(%llu)!\n", lid);
+      lu->dorelease(lids);
+    for (unsigned i = 0; i < lids.size(); ++i) {
+      lock_protocol::lockid_t lid = lids[i];
+      int tmp;
+      lock_protocol::status ret = cl->call(lock_protocol::release, lid, id, tmp);
+      if (ret != lock_protocol::OK) {
+        dprintf("lock_client_cache: lhandler thread: release RPC failed on lock(%llu)!\n", lid);
+      }
+      pthread_mutex_lock(&mx);
+      llock[lid].ls = NONE;
+      llock[lid].is_revoked = false;
+      VERIFY(pthread_cond_broadcast(&(llock[lid].lcv)) == 0);
+      pthread_mutex_unlock(&mx);
     }
-    pthread_mutex_lock(&mx);
-    llock[lid].ls = NONE;
-    llock[lid].is_revoked = false;
-    VERIFY(pthread_cond_broadcast(&(llock[lid].lcv)) == 0);
-    pthread_mutex_unlock(&mx);
   }
 }
 
@@ -68,6 +74,7 @@ lock_protocol::status
 lock_client_cache::acquire(lock_protocol::lockid_t lid)
 {
   lock_protocol::status ret = lock_protocol::OK;
+  bool fresh = false;
   {
     pthread_mutex_lock(&mx);
     if (llock.find(lid) == llock.end()) {
@@ -84,6 +91,7 @@ lock_client_cache::acquire(lock_protocol::lockid_t lid)
       }
       else if (llock[lid].ls == RETRY) {
         dprintf("client_cache: acquire lock(%llu) RETRY <break>.\n", lid);
+        fresh = true;
         break;
       }
       else if (llock[lid].ls == LOCKED) {
@@ -105,6 +113,7 @@ lock_client_cache::acquire(lock_protocol::lockid_t lid)
         /*else if (llock[lid].ls == RELEASING)
           dprintf("client_cache: acquire lock(%llu) RELEASING <sent acq RPC>.\n", lid);*/
         llock[lid].ls = ACQUIRING;
+        fresh = true;
         pthread_mutex_unlock(&mx);
         int tmp;
         ret = cl->call(lock_protocol::acquire, lid, id, tmp);
@@ -141,6 +150,8 @@ lock_client_cache::acquire(lock_protocol::lockid_t lid)
   llock[lid].ls = LOCKED;
   llock[lid].owner = pthread_self();
   pthread_mutex_unlock(&mx);
+  if (fresh && lu != NULL)
+    lu->doacquire(lid);
 
   return ret;
 }
@@ -305,3 +316,18 @@ void lock_release_eclt::dorelease(lock_protocol::lockid_t lid) {
 
   ec->flush((extent_protocol::extentid_t)lid);
 }
+
+void lock_release_eclt::dorelease(const std::vector<lock_protocol::lockid_t> &lids) {
+  if (ec == NULL) {
+    printf("lock_release_eclt: dorelease ec is NULL!\n");
+    return;
+  }
+
+  std::vector<extent_protocol::extentid_t> eids(lids.begin(), lids.end());
+  ec->flush(eids);
+}
+
+void lock_release_eclt::doacquire(lock_protocol::lockid_t lid) {
+  if (ec != NULL)
+    ec->acquired((extent_protocol::extentid_t)lid);
+}
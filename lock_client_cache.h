@@ -6,6 +6,7 @@
 
 #include <string>
 #include <queue>
+#include <vector>
 #include "lock_protocol.h"
 #include "rpc.h"
 #include "lock_client.h"
@@ -17,9 +18,17 @@
 // Classes that inherit lock_release_user can override dorelease so that 
 // that they will be called when lock_client releases a lock.
 // You will not need to do anything with this class until Lab 5.
+// doacquire is called when a lock is granted by the lock server, as
+// opposed to taken from the client's own cache of it. Locks revoked
+// together are handed to the second dorelease as one group.
 class lock_release_user {
  public:
   virtual void dorelease(lock_protocol::lockid_t) = 0;
+  virtual void dorelease(const std::vector<lock_protocol::lockid_t> &lids) {
+    for (unsigned i = 0; i < lids.size(); ++i)
+      dorelease(lids[i]);
+  }
+  virtual void doacquire(lock_protocol::lockid_t) {}
   virtual ~lock_release_user() {};
 };
 
@@ -28,6 +37,8 @@ class lock_release_eclt : public lock_release_user {
   extent_client* ec;
  public:
   void dorelease(lock_protocol::lockid_t);
+  void dorelease(const std::vector<lock_protocol::lockid_t> &);
+  void doacquire(lock_protocol::lockid_t);
   lock_release_eclt(extent_client* e){ec = e;}
   ~lock_release_eclt() {}
 };
@@ -82,13 +93,17 @@ class lock_client_cache : public lock_client {
         pthread_mutex_unlock(&hmx);
       }
 
-      lock_protocol::lockid_t outque() {
+      // wait for a revoked lock, then take every one queued by now
+      void outque(std::vector<lock_protocol::lockid_t> &lids) {
+        pthread_mutex_lock(&hmx);
         while(qlock.empty())
           pthread_cond_wait(&hcv, &hmx);
-        lock_protocol::lockid_t lid = qlock.front();
-        qlock.pop();
+        lids.clear();
+        while(!qlock.empty()) {
+          lids.push_back(qlock.front());
+          qlock.pop();
+        }
         pthread_mutex_unlock(&hmx);
-        return lid;
       }
   };
 
@@ -263,6 +263,12 @@ class handler {
 };
 
 
+// The type a handler unmarshalls an argument into: a handler may take
+// an argument by const reference, and is then passed the unmarshalled
+// copy itself rather than a copy of it.
+template<class A> struct rpc_arg { typedef A type; };
+template<class A> struct rpc_arg<const A &> { typedef A type; };
+
 // rpc server endpoint.
 class rpcs : public chanmgr {
 
@@ -348,6 +354,9 @@ class rpcs : public chanmgr {
 	tcpsconn* listener_;
 
 	public:
+	// handlers run on this many threads
+	static const int dispatch_threads = 6;
+
 	rpcs(unsigned int port, int counts=0);
 	~rpcs();
 
@@ -398,7 +407,7 @@ rpcs::reg(unsigned int proc, S*sob, int (S::*meth)(const A1 a1, R & r))
 			h1(S *xsob, int (S::*xmeth)(const A1 a1, R & r))
 				: sob(xsob), meth(xmeth) { }
 			int fn(unmarshall &args, marshall &ret) {
-				A1 a1;
+				typename rpc_arg<A1>::type a1;
 				R r;
 				args >> a1;
 				if(!args.okdone())
@@ -423,8 +432,8 @@ rpcs::reg(unsigned int proc, S*sob, int (S::*meth)(const A1 a1, const A2 a2,
 			h1(S *xsob, int (S::*xmeth)(const A1 a1, const A2 a2, R & r))
 				: sob(xsob), meth(xmeth) { }
 			int fn(unmarshall &args, marshall &ret) {
-				A1 a1;
-				A2 a2;
+				typename rpc_arg<A1>::type a1;
+				typename rpc_arg<A2>::type a2;
 				R r;
 				args >> a1;
 				args >> a2;
@@ -450,9 +459,9 @@ rpcs::reg(unsigned int proc, S*sob, int (S::*meth)(const A1 a1, const A2 a2,
 			h1(S *xsob, int (S::*xmeth)(const A1 a1, const A2 a2, const A3 a3, R & r))
 				: sob(xsob), meth(xmeth) { }
 			int fn(unmarshall &args, marshall &ret) {
-				A1 a1;
-				A2 a2;
-				A3 a3;
+				typename rpc_arg<A1>::type a1;
+				typename rpc_arg<A2>::type a2;
+				typename rpc_arg<A3>::type a3;
 				R r;
 				args >> a1;
 				args >> a2;
@@ -481,10 +490,10 @@ rpcs::reg(unsigned int proc, S*sob, int (S::*meth)(const A1 a1, const A2 a2,
 						const A4 a4, R & r))
 				: sob(xsob), meth(xmeth)  { }
 			int fn(unmarshall &args, marshall &ret) {
-				A1 a1;
-				A2 a2;
-				A3 a3;
-				A4 a4;
+				typename rpc_arg<A1>::type a1;
+				typename rpc_arg<A2>::type a2;
+				typename rpc_arg<A3>::type a3;
+				typename rpc_arg<A4>::type a4;
 				R r;
 				args >> a1;
 				args >> a2;
@@ -515,11 +524,11 @@ rpcs::reg(unsigned int proc, S*sob, int (S::*meth)(const A1 a1, const A2 a2,
 						const A4 a4, const A5 a5, R & r))
 				: sob(xsob), meth(xmeth) { }
 			int fn(unmarshall &args, marshall &ret) {
-				A1 a1;
-				A2 a2;
-				A3 a3;
-				A4 a4;
-				A5 a5;
+				typename rpc_arg<A1>::type a1;
+				typename rpc_arg<A2>::type a2;
+				typename rpc_arg<A3>::type a3;
+				typename rpc_arg<A4>::type a4;
+				typename rpc_arg<A5>::type a5;
 				R r;
 				args >> a1;
 				args >> a2;
@@ -552,12 +561,12 @@ rpcs::reg(unsigned int proc, S*sob, int (S::*meth)(const A1 a1, const A2 a2,
 						const A4 a4, const A5 a5, const A6 a6, R & r))
 				: sob(xsob), meth(xmeth) { }
 			int fn(unmarshall &args, marshall &ret) {
-				A1 a1;
-				A2 a2;
-				A3 a3;
-				A4 a4;
-				A5 a5;
-				A6 a6;
+				typename rpc_arg<A1>::type a1;
+				typename rpc_arg<A2>::type a2;
+				typename rpc_arg<A3>::type a3;
+				typename rpc_arg<A4>::type a4;
+				typename rpc_arg<A5>::type a5;
+				typename rpc_arg<A6>::type a6;
 				R r;
 				args >> a1;
 				args >> a2;
@@ -593,13 +602,13 @@ rpcs::reg(unsigned int proc, S*sob, int (S::*meth)(const A1 a1, const A2 a2,
 						const A7 a7, R & r))
 				: sob(xsob), meth(xmeth) { }
 			int fn(unmarshall &args, marshall &ret) {
-				A1 a1;
-				A2 a2;
-				A3 a3;
-				A4 a4;
-				A5 a5;
-				A6 a6;
-				A7 a7;
+				typename rpc_arg<A1>::type a1;
+				typename rpc_arg<A2>::type a2;
+				typename rpc_arg<A3>::type a3;
+				typename rpc_arg<A4>::type a4;
+				typename rpc_arg<A5>::type a5;
+				typename rpc_arg<A6>::type a6;
+				typename rpc_arg<A7>::type a7;
 				R r;
 				args >> a1;
 				args >> a2;
@@ -9,6 +9,12 @@ if [ -z $NUM_LS ]; then
     NUM_LS=0
 fi
 
+NUM_ES=$3
+
+if [ -z $NUM_ES ]; then
+    NUM_ES=1
+fi
+
 BASE_PORT=$RANDOM
 BASE_PORT=$[BASE_PORT+2000]
 EXTENT_PORT=$BASE_PORT
@@ -47,8 +53,25 @@ fi
 
 unset RPC_LOSSY
 
-echo "starting ./extent_server $EXTENT_PORT > extent_server.log 2>&1 &"
-./extent_server $EXTENT_PORT > extent_server.log 2>&1 &
+if [ $NUM_ES -gt 1 ]; then
+    x=0
+    EXTENT_DST=""
+    while [ $x -lt $NUM_ES ]; do
+      port=$[EXTENT_PORT+100+2*x]
+      echo "starting ./extent_server $port $x $NUM_ES > extent_server$x.log 2>&1 &"
+      ./extent_server $port $x $NUM_ES > extent_server$x.log 2>&1 &
+      if [ -z $EXTENT_DST ]; then
+        EXTENT_DST=$port
+      else
+        EXTENT_DST=$EXTENT_DST,$port
+      fi
+      x=$[x+1]
+    done
+    EXTENT_PORT=$EXTENT_DST
+else
+    echo "starting ./extent_server $EXTENT_PORT > extent_server.log 2>&1 &"
+    ./extent_server $EXTENT_PORT > extent_server.log 2>&1 &
+fi
 sleep 1
 
 rm -rf $YFSDIR1
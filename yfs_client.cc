@@ -29,6 +29,15 @@ yfs_client::~yfs_client()
   dprintf("yfs_client: destroying...\n");
 }
 
+// Called once the file system is unmounted. The lock client is left
+// alone: its release thread may still be handing locks back, and
+// flushing through ec as it does.
+void
+yfs_client::shutdown()
+{
+  ec->shutdown();
+}
+
 yfs_client::inum
 yfs_client::n2i(std::string n)
 {
@@ -46,11 +55,17 @@ yfs_client::filename(inum inum)
     return ost.str();
 }
 
+// Operations that only read go without the lock while ec holds a read
+// lease on what they read; otherwise they take the lock and a lease.
+// Without YFS_LEASES, has_lease is always false and lease does nothing.
 bool
 yfs_client::isfile(inum inum)
 {
   bool ret; 
+  if (ec->has_lease(inum))
+    return _isfile(inum);
   lc->acquire(inum);
+  ec->lease(inum);
   ret = _isfile(inum);
   lc->release(inum);
   return ret;
@@ -77,7 +92,10 @@ bool
 yfs_client::isdir(inum inum)
 {
   bool ret;
+  if (ec->has_lease(inum))
+    return _isdir(inum);
   lc->acquire(inum);
+  ec->lease(inum);
   ret = _isdir(inum);
   lc->release(inum);
   return ret;
@@ -93,7 +111,10 @@ int
 yfs_client::getfile(inum inum, fileinfo &fin)
 {
   int ret;
+  if (ec->has_lease(inum))
+    return _getfile(inum, fin);
   lc->acquire(inum);
+  ec->lease(inum);
   ret = _getfile(inum, fin);
   lc->release(inum);
   return ret;
@@ -126,7 +147,10 @@ int
 yfs_client::getdir(inum inum, dirinfo &din)
 {
   int ret;
+  if (ec->has_lease(inum))
+    return _getdir(inum, din);
   lc->acquire(inum);
+  ec->lease(inum);
   ret = _getdir(inum, din);
   lc->release(inum);
   return ret;
@@ -176,6 +200,11 @@ yfs_client::_setattr(inum ino, size_t size)
 {
     int r = OK;
 
+    // extents are addressed in 32 bits and end well before that
+    if ((uint64_t)size > MAXFILE * BLOCK_SIZE) {
+        return FBIG;
+    }
+
     extent_protocol::attr a;
     if (ec->getattr(ino, a) != extent_protocol::OK) {
         return IOERR;
@@ -185,22 +214,10 @@ yfs_client::_setattr(inum ino, size_t size)
         // nothing here..
     }
     else {
-        std::string buf;
-        if ((ec->get(ino, buf)) != extent_protocol::OK) {
+        // shrink, or pad w/ '\0's, on the server side
+        if ((ec->truncate(ino, size)) != extent_protocol::OK) {
             return IOERR;
         }
-        if (size < a.size) { // truncate file
-            buf = buf.substr(0, size);
-            if ((ec->put(ino, buf)) != extent_protocol::OK) {
-                return IOERR;
-            }
-        }
-        else if (size > a.size) { // pad w/ '\0's
-            buf.append((size - a.size), (char)0);
-            if ((ec->put(ino, buf)) != extent_protocol::OK) {
-                return IOERR;
-            }
-        }
     }
     // note: Since we have sent write requests back to ec(and ->es -> im),
     //       attr(e.g., size) of inode is updated, so no need to bother them explicitly.
@@ -227,52 +244,22 @@ yfs_client::_create(inum parent, const char *name, mode_t mode, inum &ino_out, b
 {
     int r = OK;
 
-    bool exist;
-    std::string buf_disk;
-    if ((_lookup(parent, name, exist, ino_out)) != OK) {
-        return IOERR;
-    }
-    if (exist) {
+    // allocate the inode and add the entry in one RPC; an existing
+    // entry comes back as EXIST with its inum
+    switch (ec->create(isdir ? extent_protocol::T_DIR : extent_protocol::T_FILE,
+                       parent, name, ino_out)) {
+    case extent_protocol::OK:
+        break;
+    case extent_protocol::EXIST:
         return EXIST;
+    default:
+        printf("yfs: error creating %s\n", isdir ? "dir" : "file");
+        return IOERR;
     }
-
-    if (isdir) {
-        if (ec->create(extent_protocol::T_DIR, ino_out) != extent_protocol::OK) {
-        //if ((int)ino_out == 0) {
-            printf("yfs: error creating dir\n");
-            r = IOERR;
-            return r;
-        }
-    } else {
-        if (ec->create(extent_protocol::T_FILE, ino_out) != extent_protocol::OK) {
-        //if ((int)ino_out == 0) {
-            printf("yfs: error creating file\n");
-            r = IOERR;
-            return r;
-        }
-    }
-
-    // build new entry
-    std::stringstream ss;
-    std::string strint;
-    std::string strentry(" ");
-    strentry.append(name);
-    strentry.append(" ");
-    ss << ino_out;
-    ss >> strint;
-    strentry.append(strint);
-
-    // Update directory
-    if ((ec->get(parent, buf_disk)) != extent_protocol::OK) {
-        r = IOERR;
-        return r;
-    }
-
-    buf_disk.append(strentry);
-    if ((ec->put(parent, buf_disk)) != extent_protocol::OK) {
-        r = IOERR;
-        return r;
-    }
+    // nobody else can find the inode while we hold the parent's lock;
+    // get its lock now, so the attributes create cached stay coherent
+    lc->acquire(ino_out);
+    lc->release(ino_out);
     if (isdir) {
       dprintf("yfs_client: create() name=%s; ino=%llu;parent=%llu ;dir\n", name, ino_out, parent);
     }
@@ -287,7 +274,10 @@ int
 yfs_client::lookup(inum parent, const char *name, bool &found, inum &ino_out)
 {
   int ret;
+  if (ec->has_lease(parent))
+    return _lookup(parent, name, found, ino_out);
   lc->acquire(parent);
+  ec->lease(parent);
   ret = _lookup(parent, name, found, ino_out);
   lc->release(parent);
   return ret;
@@ -297,28 +287,21 @@ int
 yfs_client::_lookup(inum parent, const char *name, bool &found, inum &ino_out)
 {
     int r = OK;
-    std::list<dirent> list;
-    std::list<dirent>::iterator it;
+    extent_protocol::status ret;
 
     /*
      * your lab2 code goes here.
      * note: lookup file from parent dir according to name;
      * you should design the format of directory content.
      */
-    if ((_readdir(parent, list)) != OK) {
-        return IOERR;
-    }
-
+    // the directory format is described in extent_protocol.h
     found = false;
     ino_out = 0;
-    for(it = list.begin(); it != list.end(); ++it)
-    {
-        if (((*it).name).compare(name) == 0)
-        {
-            found = true;
-            ino_out = (*it).inum;
-            break;
-        }
+    ret = ec->dir_lookup(parent, name, ino_out);
+    if (ret == extent_protocol::OK) {
+        found = true;
+    } else if (ret != extent_protocol::NOENT) {
+        return IOERR;
     }
 
     // ino_out is set to 0 if found == false
@@ -329,7 +312,10 @@ int
 yfs_client::readdir(inum dir, std::list<dirent> &list)
 {
   int ret;
+  if (ec->has_lease(dir))
+    return _readdir(dir, list);
   lc->acquire(dir);
+  ec->lease(dir);
   ret = _readdir(dir, list);
   lc->release(dir);
   return ret;
@@ -350,14 +336,6 @@ yfs_client::_readdir(inum dir, std::list<dirent> &list)
      * and push the dirents to the list.
      */
 
-    /*
-     * Seems that STL itself doesn't support container serialization :(
-     * Choose a simple way to define dir content format.
-     * <filename> <inum> <filename> <inum> ...
-     * Use space as separator.
-     * (Suppose that "blanks" should ***NOT*** exist in file names!
-     */
-
     // There are two different return value standards here extent_protocol for ec & xxstatus for yfs retval, 
     // cannot ensure their consistency, r = extent_protocal::enum is bad...
     //if ((r = ec->get(dir, dirbuf)) != extent_protocol::OK)
@@ -366,9 +344,11 @@ yfs_client::_readdir(inum dir, std::list<dirent> &list)
         return IOERR;
     }
 
-    std::istringstream ist(dirbuf);
-    while (ist >> filen) {
-        ist >> fileinum;
+    // fixed-size slots, see extent_protocol.h; free slots have inum 0
+    for (uint32_t off = 0; off + DIRENT_SIZE <= dirbuf.size(); off += DIRENT_SIZE) {
+        fileinum = dirent_unpack(dirbuf.data() + off, filen);
+        if (fileinum == 0)
+            continue;
         dire.name = filen;
         dire.inum = fileinum;
 
@@ -378,11 +358,51 @@ yfs_client::_readdir(inum dir, std::list<dirent> &list)
     return r;
 }
 
+int
+yfs_client::readdir_plus(inum dir, std::list<dirent_plus> &list)
+{
+  int ret;
+  lc->acquire(dir);
+  ret = _readdir_plus(dir, list);
+  lc->release(dir);
+  return ret;
+}
+
+// Like _readdir, but every entry comes with its attributes, and they are
+// left in ec's attribute cache for the getattr calls that usually follow.
+int
+yfs_client::_readdir_plus(inum dir, std::list<dirent_plus> &list)
+{
+    std::vector<extent_protocol::dirent_plus> ents;
+    dirent_plus dire;
+
+    if ((ec->readdir_plus(dir, ents)) != extent_protocol::OK) {
+        return IOERR;
+    }
+
+    for (uint32_t i = 0; i < ents.size(); ++i) {
+        dire.name = ents[i].name;
+        dire.inum = ents[i].inum;
+        dire.isfile = (ents[i].a.type == extent_protocol::T_FILE);
+        dire.info.atime = ents[i].a.atime;
+        dire.info.mtime = ents[i].a.mtime;
+        dire.info.ctime = ents[i].a.ctime;
+        dire.info.size = ents[i].a.size;
+
+        list.push_back(dire);
+    }
+
+    return OK;
+}
+
 int
 yfs_client::read(inum ino, size_t size, off_t off, std::string &data)
 {
   int ret;
+  if (ec->has_lease(ino))
+    return _read(ino, size, off, data);
   lc->acquire(ino);
+  ec->lease(ino);
   ret = _read(ino, size, off, data);
   lc->release(ino);
   return ret;
@@ -392,26 +412,23 @@ int
 yfs_client::_read(inum ino, size_t size, off_t off, std::string &data)
 {
     int r = OK;
-    std::string buf;
 
     /*
      * your lab2 code goes here.
      * note: read using ec->get().
      */
 
-    if ((ec->get(ino, buf)) != extent_protocol::OK) {
-        return IOERR;
+    // nothing lies past the largest file, and such an off would not
+    // survive the 32-bit offsets of get_range
+    data.clear();
+    if (off < 0 || (uint64_t)off >= MAXFILE * BLOCK_SIZE) {
+        return r;
     }
 
-    /*
-    if (off >= buf.size())
-        data = "";
-    else if (off + size >= buf.size())
-        data = buf.substr(off);
-    else
-        data = buf.substr(off, size);
-    */
-    data = buf.substr(off, size);
+    // only the requested range is fetched; it is cut at EOF
+    if ((ec->get_range(ino, off, size, data)) != extent_protocol::OK) {
+        return IOERR;
+    }
     return r;
 }
 
@@ -431,14 +448,11 @@ yfs_client::_write(inum ino, size_t size, off_t off, const char *data,
         size_t &bytes_written)
 {
     int r = OK;
-    std::string buf_disk;
 
     if (!data) {
         printf("!! yfs_client: write(): data is NULL!\n");
         return IOERR;
     }
-    std::string strdata(data, size);
-
     //printf("zzz: yfs:write: ino(%llu), sz(%u), data=(%s)\n", ino, size, data);
 
     /*
@@ -446,27 +460,16 @@ yfs_client::_write(inum ino, size_t size, off_t off, const char *data,
      * note: write using ec->put().
      * when off > length of original file, fill the holes with '\0'.
      */
+    // ec/es fill any hole in front of off with '\0's; data goes
+    // straight into the cached pages
     bytes_written = 0;
-    if ((ec->get(ino, buf_disk)) != extent_protocol::OK) {
-        return NOENT;
-    }
-
-    if (buf_disk.length() >= off) {
-        strdata = strdata.substr(0, size);
-        buf_disk.replace(off, size, strdata);
-        bytes_written += (size);
-    }
-    else {
-        bytes_written += (off - buf_disk.length());
-        buf_disk.append((off - buf_disk.length()), (char)0/*'\0'*/);
-        strdata = strdata.substr(0, size);
-        buf_disk = buf_disk.append(strdata);
-        bytes_written += (size);
+    if (off < 0 || (uint64_t)off + size > MAXFILE * BLOCK_SIZE) {
+        return FBIG;
     }
-
-    if ((ec->put(ino, buf_disk)) != extent_protocol::OK) {
+    if ((ec->put_range(ino, off, data, size)) != extent_protocol::OK) {
         return IOERR;
     }
+    bytes_written = size;
 
     return r;
 }
@@ -490,47 +493,18 @@ int yfs_client::_unlink(inum parent,const char *name)
      * and update the parent directory content.
      */
 
-    bool exist;
-    std::string buf_disk;
     inum ino;
+    extent_protocol::status ret;
 
-    if ((_lookup(parent, name, exist, ino)) != OK) {
+    // drop the entry first, so the name is gone before the inode is
+    ret = ec->dir_remove(parent, name, ino);
+    if (ret == extent_protocol::NOENT) {
         return NOENT;
-    }
-
-    if ((ec->remove(ino)) != extent_protocol::OK) {
+    } else if (ret != extent_protocol::OK) {
         return IOERR;
     }
-    // Update parent's Entry
-    std::list<dirent> list;
-    std::list<dirent>::iterator it;
 
-    r = _readdir(parent, list);
-    if (r != OK) {
-        return r;
-    }
-
-    // Write dir's content list back to disk
-    buf_disk = "";
-    for(it = list.begin(); it != list.end(); ++it)
-    {
-        if (((*it).name).compare(name) == 0) {
-            // Success of Lookup should guarantee if & only if 1 condition walk through here
-            continue;
-        }
-        else {
-            buf_disk.append(" ");
-            buf_disk.append((*it).name);
-            buf_disk.append(" ");
-            std::stringstream ss;
-            std::string strint;
-            ss << (*it).inum;
-            ss >> strint;
-            buf_disk.append(strint);
-        }
-    }
-
-    if ((ec->put(parent, buf_disk)) != extent_protocol::OK) {
+    if ((ec->remove(ino)) != extent_protocol::OK) {
         return IOERR;
     }
 
@@ -19,7 +19,7 @@ class yfs_client {
  public:
 
   typedef unsigned long long inum;
-  enum xxstatus { OK, RPCERR, NOENT, IOERR, EXIST };
+  enum xxstatus { OK, RPCERR, NOENT, IOERR, EXIST, FBIG };
   typedef int status;
 
   struct fileinfo {
@@ -37,6 +37,12 @@ class yfs_client {
     std::string name;
     yfs_client::inum inum;
   };
+  struct dirent_plus {
+    std::string name;
+    yfs_client::inum inum;
+    bool isfile;
+    fileinfo info;
+  };
 
  private:
   static std::string filename(inum);
@@ -45,6 +51,7 @@ class yfs_client {
  public:
   yfs_client(std::string, std::string);
   ~yfs_client();
+  void shutdown();
 
   bool _isfile(inum);
   bool _isdir(inum);
@@ -56,6 +63,7 @@ class yfs_client {
   int _lookup(inum, const char *, bool &, inum &);
   int _create(inum, const char *, mode_t, inum &, bool isdir);
   int _readdir(inum, std::list<dirent> &);
+  int _readdir_plus(inum, std::list<dirent_plus> &);
   int _write(inum, size_t, off_t, const char *, size_t &);
   int _read(inum, size_t, off_t, std::string &);
   int _unlink(inum,const char *);
@@ -70,6 +78,7 @@ class yfs_client {
   int lookup(inum, const char *, bool &, inum &);
   int create(inum, const char *, mode_t, inum &, bool isdir);
   int readdir(inum, std::list<dirent> &);
+  int readdir_plus(inum, std::list<dirent_plus> &);
   int write(inum, size_t, off_t, const char *, size_t &);
   int read(inum, size_t, off_t, std::string &);
   int unlink(inum,const char *);